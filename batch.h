@@ -0,0 +1,433 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include "buffer_pool.h"
+#include "dedup_cache.h"
+#include "discovery.h"
+#include "encode_profile.h"
+#include "fanout.h"
+#include "journal.h"
+#include "metrics.h"
+#include "pipeline.h"
+#include "thread_pool.h"
+
+namespace fs = std::filesystem;
+
+// command-line settings shared by all programs
+struct BatchOptions {
+    int threads = 0;             // 0 = std::thread::hardware_concurrency()
+    bool largest_first = false;  // start the biggest files first
+    PipelineOptions pipeline;    // --pipeline runs staged instead of file-per-task
+    std::string journal;         // progress journal, empty = none
+    EncodeProfile encode = EncodeProfile::standard;
+    bool report_stats = false;  // print encode (and cache) totals at the end
+    std::string metrics;        // JSON report of the batch, empty = none, "-" = stdout
+    double progress = 0;        // seconds between progress lines, 0 = none
+    DiscoveryOptions discovery;  // which files under the folder are processed
+    bool dedup = false;          // reuse the outputs of byte-identical inputs
+    int dedup_mb = 0;            // cache capacity, 0 = the default of its kind
+    std::string dedup_dir;       // persistent cache folder, empty = in memory
+};
+
+constexpr const char* DEFAULT_JOURNAL = "rotate.journal";
+constexpr const char* DEFAULT_METRICS = "rotate.metrics.json";
+constexpr double DEFAULT_PROGRESS_SECONDS = 5;
+constexpr int DEFAULT_DEDUP_MB = 256;       // in memory
+constexpr int DEFAULT_DEDUP_DIR_MB = 4096;  // on disk
+
+// threads listing folders for --pipeline, whose stages have threads of their own
+constexpr int PIPELINE_DISCOVERY_THREADS = 2;
+
+inline const char* batch_usage() {
+    return "[--threads=N] [--largest-first] [--pipeline[=READ,DECODE,ROTATE,ENCODE]] [--queue-depth=N] [--pipeline-stats] [--io-uring] [--journal[=FILE]] [--encode=fastest|balanced|smallest|adaptive] [--stats] [--metrics[=FILE]] [--progress[=SECONDS]] [--recursive] [--extensions=png,...] [--dedup[=MB]] [--dedup-dir=DIR]";
+}
+
+// returns false if arg is not a batch option
+inline bool parse_batch_option(BatchOptions& options, const std::string& arg) {
+    if (arg.rfind("--threads=", 0) == 0) {
+        try {
+            options.threads = std::stoi(arg.substr(10));
+        } catch (const std::exception&) {
+            return false;
+        }
+        return options.threads > 0;
+    }
+    if (arg == "--largest-first") {
+        options.largest_first = true;
+        return true;
+    }
+    if (arg == "--pipeline") {
+        options.pipeline.enabled = true;
+        return true;
+    }
+    if (arg.rfind("--pipeline=", 0) == 0) {
+        PipelineOptions& p = options.pipeline;
+        p.enabled = true;
+        char extra;
+        return std::sscanf(arg.c_str() + 11, "%d,%d,%d,%d%c", &p.read_threads, &p.decode_threads,
+                           &p.rotate_threads, &p.encode_threads, &extra) == 4 &&
+               p.read_threads > 0 && p.decode_threads > 0 && p.rotate_threads > 0 && p.encode_threads > 0;
+    }
+    if (arg.rfind("--queue-depth=", 0) == 0) {
+        try {
+            options.pipeline.queue_depth = std::stoi(arg.substr(14));
+        } catch (const std::exception&) {
+            return false;
+        }
+        return options.pipeline.queue_depth > 0;
+    }
+    if (arg == "--journal") {
+        options.journal = DEFAULT_JOURNAL;
+        return true;
+    }
+    if (arg.rfind("--journal=", 0) == 0) {
+        options.journal = arg.substr(10);
+        return !options.journal.empty();
+    }
+    if (arg == "--io-uring") {
+        options.pipeline.enabled = true;
+        options.pipeline.io_uring = true;
+        return true;
+    }
+    if (arg == "--pipeline-stats") {
+        options.pipeline.stats = true;
+        options.report_stats = true;
+        return true;
+    }
+    if (arg == "--stats") {
+        options.report_stats = true;
+        return true;
+    }
+    if (arg.rfind("--encode=", 0) == 0) {
+        options.report_stats = true;
+        return parse_encode_profile(arg.substr(9), options.encode);
+    }
+    if (arg == "--recursive") {
+        options.discovery.recursive = true;
+        return true;
+    }
+    if (arg.rfind("--extensions=", 0) == 0) {
+        return parse_extensions(arg.substr(13), options.discovery.extensions);
+    }
+    if (arg == "--metrics") {
+        options.metrics = DEFAULT_METRICS;
+        return true;
+    }
+    if (arg.rfind("--metrics=", 0) == 0) {
+        options.metrics = arg.substr(10);
+        return !options.metrics.empty();
+    }
+    if (arg == "--dedup") {
+        options.dedup = true;
+        return true;
+    }
+    if (arg.rfind("--dedup=", 0) == 0) {
+        options.dedup = true;
+        try {
+            options.dedup_mb = std::stoi(arg.substr(8));
+        } catch (const std::exception&) {
+            return false;
+        }
+        return options.dedup_mb > 0;
+    }
+    if (arg.rfind("--dedup-dir=", 0) == 0) {
+        options.dedup = true;
+        options.dedup_dir = arg.substr(12);
+        return !options.dedup_dir.empty();
+    }
+    if (arg == "--progress") {
+        options.progress = DEFAULT_PROGRESS_SECONDS;
+        return true;
+    }
+    if (arg.rfind("--progress=", 0) == 0) {
+        try {
+            options.progress = std::stod(arg.substr(11));
+        } catch (const std::exception&) {
+            return false;
+        }
+        return options.progress > 0;
+    }
+    return false;
+}
+
+inline int batch_thread_count(const BatchOptions& options) {
+    if (options.threads > 0)
+        return options.threads;
+    unsigned hw = std::thread::hardware_concurrency();
+    return hw > 0 ? static_cast<int>(hw) : 1;
+}
+
+// Open the journal and finish what an interrupted run left half done; the
+// files it already finished are skipped as they are found.
+inline std::unique_ptr<Journal> open_journal(const BatchOptions& options) {
+    if (options.journal.empty())
+        return nullptr;
+    auto journal = std::make_unique<Journal>(options.journal);
+    journal->recover();
+    return journal;
+}
+
+// The cache of --dedup, with the outputs already in its folder indexed.
+inline std::unique_ptr<DedupCache> open_dedup_cache(const BatchOptions& options) {
+    if (!options.dedup)
+        return nullptr;
+    int mb = options.dedup_mb > 0 ? options.dedup_mb
+                                  : options.dedup_dir.empty() ? DEFAULT_DEDUP_MB : DEFAULT_DEDUP_DIR_MB;
+    auto cache = std::make_unique<DedupCache>(static_cast<size_t>(mb) << 20, options.dedup_dir);
+    cache->open();
+    return cache;
+}
+
+inline void sort_largest_first(std::vector<fs::path>& image_paths) {
+    std::vector<std::pair<uintmax_t, fs::path>> sized;
+    sized.reserve(image_paths.size());
+    for (auto& path : image_paths) {
+        std::error_code ec;
+        uintmax_t size = fs::file_size(path, ec);
+        sized.emplace_back(ec ? 0 : size, std::move(path));
+    }
+    std::stable_sort(sized.begin(), sized.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+    image_paths.clear();
+    for (auto& entry : sized) {
+        image_paths.push_back(std::move(entry.second));
+    }
+}
+
+// Run process on every image under folder using a work-stealing pool, so a
+// thread that drew a cluster of large files no longer holds up the whole
+// batch. Folders are listed by tasks on the same pool and each image is queued
+// as soon as it is found, so rotation starts while the tree is still being
+// walked. Only --largest-first waits for the whole tree, to sort it. accept
+// drops files that are not to be processed. A file whose process throws is
+// reported (and journaled) and the batch carries on.
+inline void run_files(const fs::path& folder, const BatchOptions& options,
+                      const std::function<bool(const fs::path&)>& accept,
+                      const std::function<void(const fs::path&)>& process) {
+    ThreadPool pool(batch_thread_count(options));
+    int workers = pool.size();
+    auto run_one = [&process](const fs::path& path) {
+        try {
+            process(path);
+        } catch (const std::exception& e) {
+            report_failure(path, e);
+        }
+    };
+
+    if (options.largest_first) {
+        std::mutex found_mutex;
+        std::vector<fs::path> image_paths;
+        discover_images(pool, folder, options.discovery, [&](const fs::path& path) {
+            if (accept(path)) {
+                std::lock_guard<std::mutex> lock(found_mutex);
+                image_paths.push_back(path);
+            }
+        });
+        pool.wait_idle();
+        sort_largest_first(image_paths);
+
+        // deal the files round-robin, each worker starts on its first one
+        Prefetcher prefetcher(image_paths);
+        for (size_t i = 0; i < image_paths.size(); ++i) {
+            pool.submit_deferred(static_cast<int>(i % workers), [&, i]() {
+                prefetcher.advance(i);
+                run_one(image_paths[i]);
+            });
+        }
+        pool.wait_idle();
+        return;
+    }
+
+    // files are dealt round-robin in the order they are found
+    PathStream image_paths;
+    Prefetcher prefetcher(image_paths);
+    discover_images(pool, folder, options.discovery, [&](const fs::path& path) {
+        if (!accept(path))
+            return;
+        size_t i = image_paths.push(path);
+        pool.submit_deferred(static_cast<int>(i % workers), [&, i]() {
+            prefetcher.advance(i);
+            run_one(image_paths[i]);
+        });
+    });
+    pool.wait_idle();
+}
+
+// Process every image under folder: one task per file on the pool, or with
+// --pipeline through the staged pipeline, which only needs the rotation step
+// of each output. Either way the images are processed while the folder is
+// still being walked. With --journal, files finished by an earlier run are
+// skipped; with --dedup, inputs seen before are answered from the cache;
+// --metrics and --progress report per-stage timings while and after it runs.
+// Returns false if the batch could not be started.
+inline bool run_batch(const fs::path& folder, const BatchOptions& options,
+                      const std::function<void(const fs::path&)>& process,
+                      const std::vector<RotationOutput>& outputs) {
+    std::error_code ec;
+    if (!fs::is_directory(folder, ec)) {
+        std::cerr << "Error: " << folder << " is not a folder" << std::endl;
+        return false;
+    }
+    std::unique_ptr<Journal> journal;
+    std::unique_ptr<DedupCache> dedup;
+    try {
+        journal = open_journal(options);
+        dedup = open_dedup_cache(options);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return false;
+    }
+    active_journal = journal.get();
+    active_dedup = dedup.get();
+    active_encode_profile = options.encode;
+    metrics_enabled = !options.metrics.empty() || options.progress > 0;
+
+    // images found so far, and those an earlier run finished; the journal
+    // records outputs, so an input is finished once all of its outputs are
+    std::atomic<uint64_t> inputs{0};
+    std::atomic<uint64_t> skipped{0};
+    auto finished = [&](const fs::path& path) {
+        for (const RotationOutput& output : outputs) {
+            if (!journal->is_done(output_path_for(path, output)))
+                return false;
+        }
+        return true;
+    };
+    auto accept = [&](const fs::path& path) {
+        if (journal && finished(path)) {
+            skipped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        inputs.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    auto elapsed = [&]() { return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(); };
+
+    std::mutex progress_mutex;
+    std::condition_variable progress_stop;
+    bool done = false;
+    std::thread progress;
+    if (options.progress > 0) {
+        progress = std::thread([&]() {
+            std::unique_lock<std::mutex> lock(progress_mutex);
+            auto interval = std::chrono::duration<double>(options.progress);
+            while (!progress_stop.wait_for(lock, interval, [&]() { return done; })) {
+                print_progress(std::cerr, metrics_snapshot(), inputs.load() * outputs.size(), elapsed());
+            }
+        });
+    }
+    // true if there was a progress thread to stop
+    auto stop_progress = [&]() {
+        if (!progress.joinable())
+            return false;
+        {
+            std::lock_guard<std::mutex> lock(progress_mutex);
+            done = true;
+        }
+        progress_stop.notify_one();
+        progress.join();
+        return true;
+    };
+
+    try {
+        if (options.pipeline.enabled) {
+            // the walk runs on a small pool of its own and feeds the read stage;
+            // with --largest-first the paths are held back until the whole tree is
+            // listed and sorted
+            PathStream image_paths;
+            ThreadPool walkers(PIPELINE_DISCOVERY_THREADS);
+            std::mutex found_mutex;
+            std::vector<fs::path> found;
+            discover_images(walkers, folder, options.discovery, [&](const fs::path& path) {
+                if (!accept(path))
+                    return;
+                if (!options.largest_first) {
+                    image_paths.push(path);
+                    return;
+                }
+                std::lock_guard<std::mutex> lock(found_mutex);
+                found.push_back(path);
+            });
+            std::thread closer([&]() {
+                walkers.wait_idle();
+                sort_largest_first(found);
+                for (auto& path : found) {
+                    image_paths.push(std::move(path));
+                }
+                image_paths.close();
+            });
+            try {
+                run_pipeline(image_paths, options.pipeline, batch_thread_count(options), outputs);
+            } catch (...) {
+                // the walk still feeds image_paths and found
+                closer.join();
+                throw;
+            }
+            closer.join();
+        } else if (dedup) {
+            run_files(folder, options, accept, [&](const fs::path& path) {
+                process_deduplicated(path, outputs, process);
+            });
+        } else {
+            run_files(folder, options, accept, process);
+        }
+    } catch (...) {
+        active_journal = nullptr;
+        active_dedup = nullptr;
+        stop_progress();
+        throw;
+    }
+    active_journal = nullptr;
+    active_dedup = nullptr;
+    double seconds = elapsed();
+    if (skipped > 0) {
+        std::cerr << "Journal " << options.journal << ": skipped " << skipped << " finished files" << std::endl;
+    }
+
+    if (stop_progress()) {
+        print_progress(std::cerr, metrics_snapshot(), inputs.load() * outputs.size(), seconds);
+    }
+    if (options.report_stats) {
+        print_encode_stats(std::cout, options.encode);
+        print_buffer_pool_stats(std::cout);
+        if (dedup)
+            print_dedup_stats(std::cout, *dedup);
+    }
+    if (!options.metrics.empty()) {
+        size_t peak_image_bytes = image_memory.peak.load();
+        if (options.metrics == "-") {
+            write_metrics_json(std::cout, metrics_snapshot(), inputs.load(), seconds, peak_image_bytes);
+        } else {
+            std::ofstream out(options.metrics);
+            write_metrics_json(out, metrics_snapshot(), inputs.load(), seconds, peak_image_bytes);
+            if (!out)
+                std::cerr << "Error: could not write metrics to " << options.metrics << std::endl;
+        }
+    }
+    return true;
+}
+
+// the usual batch: every image is replaced by its rotation, which transform
+// describes (RotationOutput::transform)
+inline bool run_batch(const fs::path& folder, const BatchOptions& options,
+                      const std::function<void(const fs::path&)>& process,
+                      const std::function<Image(const Image&)>& rotate, const std::string& transform) {
+    return run_batch(folder, options, process, {RotationOutput{"", fs::path(), rotate, transform}});
+}
@@ -0,0 +1,571 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "dispatch.h"
+#include "encode_profile.h"
+#include "image.h"
+#include "map_cache.h"
+#include "png_io.h"
+#include "recursive.h"
+#include "rotate.h"
+#include "shear.h"
+#include "thread_pool.h"
+#include "transpose.h"
+
+// Benchmark of the decode, rotate and encode steps on synthetic images, plus
+// whole files (decode + rotate + encode) on the thread pool at several thread
+// counts. Nothing touches the disk.
+
+// clockwise, in degrees, as in v3.cpp
+constexpr double BENCH_ANGLE = 110.0;
+
+// source colour types of the synthetic PNGs
+enum class SourceFormat {
+    rgba,
+    rgb,
+    gray,
+    palette,
+    rgba16,
+};
+
+const char* format_name(SourceFormat format) {
+    switch (format) {
+    case SourceFormat::rgb:
+        return "rgb";
+    case SourceFormat::gray:
+        return "gray";
+    case SourceFormat::palette:
+        return "palette";
+    case SourceFormat::rgba16:
+        return "rgba16";
+    default:
+        return "rgba";
+    }
+}
+
+bool parse_format(const std::string& name, SourceFormat& format) {
+    for (SourceFormat f : {SourceFormat::rgba, SourceFormat::rgb, SourceFormat::gray, SourceFormat::palette,
+                            SourceFormat::rgba16}) {
+        if (name == format_name(f)) {
+            format = f;
+            return true;
+        }
+    }
+    return false;
+}
+
+struct BenchSize {
+    int width;
+    int height;
+};
+
+std::string size_name(const BenchSize& size) {
+    return std::to_string(size.width) + "x" + std::to_string(size.height);
+}
+
+struct BenchOptions {
+    std::vector<BenchSize> sizes = {{640, 480}, {1920, 1080}};
+    std::vector<SourceFormat> formats = {SourceFormat::rgba, SourceFormat::rgb, SourceFormat::gray, SourceFormat::palette,
+                                         SourceFormat::rgba16};
+    std::vector<std::string> kernels;  // empty = all
+    std::vector<int> threads;          // empty = 1, 2, 4, ... up to the core count
+    int files = 16;                    // per thread-scaling run
+    double min_time = 0.5;             // seconds per measurement
+    std::string save;                  // write the results here
+    std::string compare;               // compare against results saved earlier
+    double tolerance = 10.0;           // percent slower that counts as a regression
+    bool check = false;                // run the correctness checks instead of timing
+};
+
+// Synthetic content: smooth gradients with a little noise, a few hard-edged
+// shapes and a transparent hole, so the codecs see something between a photo
+// and a flat graphic. Deterministic, every run sees the same pixels.
+Image make_synthetic(const BenchSize& size) {
+    Image image(size.width, size.height);
+    uint32_t state = 0x9e3779b9u;
+    auto next = [&state]() {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    };
+    int cx = size.width / 2;
+    int cy = size.height / 2;
+    long r2 = static_cast<long>(std::min(size.width, size.height)) * std::min(size.width, size.height) / 16;
+    for (int y = 0; y < size.height; ++y) {
+        unsigned char* p = image.row(y);
+        for (int x = 0; x < size.width; ++x, p += RGBA_PIXEL_BYTES) {
+            uint32_t noise = next();
+            int n = static_cast<int>(noise & 7) - 4;
+            bool stripe = ((x / 37) + (y / 29)) % 5 == 0;
+            p[0] = static_cast<unsigned char>(std::clamp(x * 255 / std::max(1, size.width - 1) + n, 0, 255));
+            p[1] = static_cast<unsigned char>(std::clamp(y * 255 / std::max(1, size.height - 1) + n, 0, 255));
+            p[2] = stripe ? 230 : static_cast<unsigned char>(std::clamp(128 + ((x ^ y) & 31) + n, 0, 255));
+            long dx = x - cx;
+            long dy = y - cy;
+            p[3] = dx * dx + dy * dy < r2 ? 0 : 255;
+        }
+    }
+    return image;
+}
+
+// the RGBA synthetic image in the given colour type; the palette is 3-3-2 and
+// 16-bit samples are the 8-bit ones times 257
+Image convert_to(const Image& image, SourceFormat format) {
+    PixelFormat f;
+    if (format == SourceFormat::rgba16) {
+        f = rgba_format(16);
+    } else if (format == SourceFormat::rgb) {
+        f.layout = PixelLayout::rgb;
+    } else if (format == SourceFormat::gray) {
+        f.layout = PixelLayout::gray;
+    } else if (format == SourceFormat::palette) {
+        auto palette = std::make_shared<Palette>();
+        for (int i = 0; i < 256; ++i) {
+            palette->entries[i] = {static_cast<unsigned char>((i & 0xe0) * 255 / 0xe0),
+                                   static_cast<unsigned char>(((i >> 2) & 0x7) * 255 / 7),
+                                   static_cast<unsigned char>((i & 0x3) * 255 / 3), 255};
+        }
+        palette->size = 256;
+        f.layout = PixelLayout::palette;
+        f.palette = std::move(palette);
+    }
+
+    Image converted(image.width, image.height, f);
+    for (int y = 0; y < image.height; ++y) {
+        const unsigned char* p = image.row(y);
+        unsigned char* q = converted.row(y);
+        for (int x = 0; x < image.width; ++x, p += RGBA_PIXEL_BYTES) {
+            if (format == SourceFormat::rgba) {
+                std::memcpy(q, p, 4);
+                q += 4;
+            } else if (format == SourceFormat::rgba16) {
+                for (int c = 0; c < 4; ++c, q += 2) {
+                    const uint16_t v = static_cast<uint16_t>(p[c] * 257);
+                    std::memcpy(q, &v, 2);
+                }
+            } else if (format == SourceFormat::rgb) {
+                q[0] = p[0];
+                q[1] = p[1];
+                q[2] = p[2];
+                q += 3;
+            } else if (format == SourceFormat::gray) {
+                *q++ = static_cast<unsigned char>((p[0] * 77 + p[1] * 150 + p[2] * 29) >> 8);
+            } else {
+                *q++ = static_cast<unsigned char>((p[0] & 0xe0) | ((p[1] & 0xe0) >> 3) | (p[2] >> 6));
+            }
+        }
+    }
+    return converted;
+}
+
+// Seconds per call of fn: one warm-up call, then calls until min_time has
+// passed (at least three).
+double time_per_call(double min_time, const std::function<void()>& fn) {
+    using clock = std::chrono::steady_clock;
+    fn();
+    int calls = 0;
+    auto start = clock::now();
+    double elapsed = 0.0;
+    while (calls < 3 || elapsed < min_time) {
+        fn();
+        ++calls;
+        elapsed = std::chrono::duration<double>(clock::now() - start).count();
+    }
+    return elapsed / calls;
+}
+
+struct BenchResult {
+    std::string key;  // stage/variant/size
+    double mpix_per_second;
+    double files_per_second;
+    std::string note;
+};
+
+void print_result(const BenchResult& r) {
+    std::cout << std::left << std::setw(44) << r.key << std::right << std::fixed << std::setprecision(1)
+              << std::setw(10) << r.mpix_per_second << " MPix/s" << std::setw(10) << r.files_per_second << " files/s";
+    if (!r.note.empty())
+        std::cout << "  " << r.note;
+    std::cout << std::endl;
+}
+
+// a rotation under test, applied to a decoded image of each source format
+struct BenchKernel {
+    std::string name;
+    std::function<Image(const Image&)> rotate;
+};
+
+std::vector<BenchKernel> all_kernels() {
+    return {
+        {"v2", [](const Image& s) { return orient_image<Orientation::rotate_90>(s); }},
+        {"v2rec", [](const Image& s) { return rotate_image_recursive_90(s); }},
+        {"v3-reference", [](const Image& s) { return rotate_image_reference(s, BENCH_ANGLE); }},
+        {"v3-reference-mapped", [](const Image& s) { return rotate_image_cached(s, BENCH_ANGLE); }},
+        {"v3-fixed", [](const Image& s) { return rotate_image_fixed(s, BENCH_ANGLE); }},
+        {"v3-fixed-bilinear", [](const Image& s) { return rotate_image_fixed(s, BENCH_ANGLE, Interpolation::bilinear); }},
+        {"v3-fixed-bicubic", [](const Image& s) { return rotate_image_fixed(s, BENCH_ANGLE, Interpolation::bicubic); }},
+        {"v3-shear", [](const Image& s) { return rotate_image_shear(s, BENCH_ANGLE); }},
+        {"v3-dispatch-180", [](const Image& s) {
+             return rotate_transform(s, rotation_by(180.0), [](const Image& i, double a) { return rotate_image_fixed(i, a); });
+         }},
+        {"v3rec", [](const Image& s) { return rotate_image_recursive(s, BENCH_ANGLE, Interpolation::nearest); }},
+    };
+}
+
+bool selected(const BenchOptions& options, const std::string& name) {
+    return options.kernels.empty() ||
+           std::find(options.kernels.begin(), options.kernels.end(), name) != options.kernels.end();
+}
+
+void run_benchmarks(const BenchOptions& options, std::vector<BenchResult>& results) {
+    auto add = [&results](BenchResult r) {
+        print_result(r);
+        results.push_back(std::move(r));
+    };
+
+    for (const BenchSize& size : options.sizes) {
+        Image source = make_synthetic(size);
+        double mpix = static_cast<double>(size.width) * size.height / 1e6;
+        std::cout << "== " << size_name(size) << std::endl;
+
+        // decode, per source colour type; images stay in their own format
+        std::vector<unsigned char> rgba_png;
+        std::vector<std::pair<SourceFormat, Image>> decoded_formats;
+        for (SourceFormat format : options.formats) {
+            std::vector<unsigned char> png;
+            encode_png(convert_to(source, format), png, EncodeProfile::standard);
+            if (format == SourceFormat::rgba)
+                rgba_png = png;
+            Image decoded;
+            double t = time_per_call(options.min_time, [&]() { decode_png(png.data(), png.size(), decoded); });
+            add({std::string("decode/") + format_name(format) + "/" + size_name(size), mpix / t, 1.0 / t,
+                 std::to_string(png.size() / 1024) + " KB"});
+            decoded_formats.emplace_back(format, std::move(decoded));
+        }
+        if (rgba_png.empty())
+            encode_png(source, rgba_png, EncodeProfile::standard);
+
+        // v2's streaming reader decodes and rotates in one pass
+        if (selected(options, "v2-stream")) {
+            Image rotated;
+            double t = time_per_call(options.min_time, [&]() {
+                decode_png_rotated_90(rgba_png.data(), rgba_png.size(), rotated);
+            });
+            add({"decode+rotate/v2-stream/" + size_name(size), mpix / t, 1.0 / t, ""});
+        }
+
+        // rotation kernels, single-threaded; RGBA keeps the keys of earlier runs
+        for (const BenchKernel& kernel : all_kernels()) {
+            if (!selected(options, kernel.name))
+                continue;
+            for (const auto& [format, decoded] : decoded_formats) {
+                double t = time_per_call(options.min_time, [&]() { Image rotated = kernel.rotate(decoded); });
+                std::string variant = format == SourceFormat::rgba ? kernel.name
+                                                                   : kernel.name + "/" + format_name(format);
+                add({"rotate/" + variant + "/" + size_name(size), mpix / t, 1.0 / t, ""});
+            }
+        }
+
+        // encode, per profile
+        for (EncodeProfile profile : {EncodeProfile::standard, EncodeProfile::fastest, EncodeProfile::balanced,
+                                      EncodeProfile::smallest, EncodeProfile::adaptive}) {
+            std::vector<unsigned char> bytes;
+            double t = time_per_call(options.min_time, [&]() { encode_png(source, bytes, profile); });
+            std::ostringstream note;
+            note << bytes.size() / 1024 << " KB (" << std::setprecision(1) << std::fixed
+                 << 100.0 * bytes.size() / (mpix * 1e6 * RGBA_PIXEL_BYTES) << "%)";
+            add({std::string("encode/") + encode_profile_name(profile) + "/" + size_name(size), mpix / t, 1.0 / t,
+                 note.str()});
+        }
+
+        // whole files on the pool: decode, rotate with the default engine, encode
+        double base_rate = 0.0;
+        for (int threads : options.threads) {
+            double t = time_per_call(options.min_time, [&]() {
+                ThreadPool pool(threads);
+                for (int i = 0; i < options.files; ++i) {
+                    pool.submit([&rgba_png]() {
+                        Image decoded;
+                        decode_png(rgba_png.data(), rgba_png.size(), decoded);
+                        Image rotated = rotate_image_fixed(decoded, BENCH_ANGLE);
+                        thread_local std::vector<unsigned char> bytes;
+                        encode_png(rotated, bytes);
+                    });
+                }
+                pool.wait_idle();
+            });
+            double files_per_second = options.files / t;
+            if (base_rate == 0.0)
+                base_rate = files_per_second;
+            std::ostringstream note;
+            note << "x" << std::setprecision(2) << std::fixed << files_per_second / base_rate;
+            add({"files/threads=" + std::to_string(threads) + "/" + size_name(size), files_per_second * mpix,
+                 files_per_second, note.str()});
+        }
+    }
+}
+
+// RGBA pixels of a and b that differ. Unless exact, colour only counts where
+// alpha is not 0: premultiplied interpolation drops the colour of transparent
+// pixels.
+int count_differences(const Image& a, const Image& b, bool exact = false) {
+    return with_sample_type(a.format, [&](auto sample) {
+        using T = decltype(sample);
+        int differences = 0;
+        for (int y = 0; y < a.height; ++y) {
+            const T* p = reinterpret_cast<const T*>(a.row(y));
+            const T* q = reinterpret_cast<const T*>(b.row(y));
+            for (int x = 0; x < a.width; ++x, p += 4, q += 4) {
+                bool same = p[3] == q[3] && ((p[3] == 0 && !exact) || (p[0] == q[0] && p[1] == q[1] && p[2] == q[2]));
+                differences += !same;
+            }
+        }
+        return differences;
+    });
+}
+
+// Rotate with active_simd_level set to level, then restore it.
+Image rotate_at_level(SimdLevel level, const std::function<Image()>& rotate) {
+    SimdLevel saved = active_simd_level;
+    active_simd_level = level;
+    Image rotated = rotate();
+    active_simd_level = saved;
+    return rotated;
+}
+
+// --check: a rotation by 0 degrees has to reproduce the source with every
+// interpolating kernel, and every SIMD level of the host has to give the
+// scalar kernels' pixels exactly. Returns the number of failed checks.
+int run_checks(const BenchOptions& options) {
+    struct Check {
+        std::string name;
+        std::function<Image(const Image&)> rotate;
+        std::function<Image(const Image&)> expected;  // empty = the source in RGBA
+    };
+    std::vector<Check> checks;
+    for (Interpolation interpolation : {Interpolation::bilinear, Interpolation::bicubic}) {
+        std::string name = std::string("0deg-") + interpolation_name(interpolation);
+        checks.push_back({name + "/v3-fixed", [interpolation](const Image& s) {
+                              return rotate_image_fixed(s, 0.0, interpolation);
+                          }, nullptr});
+        checks.push_back({name + "/v3rec", [interpolation](const Image& s) {
+                              return rotate_image_recursive(s, 0.0, interpolation);
+                          }, nullptr});
+    }
+    for (SimdLevel level : {SimdLevel::sse2, SimdLevel::avx2, SimdLevel::avx512}) {
+        if (level > detect_simd_level())
+            continue;
+        for (Interpolation interpolation : {Interpolation::bilinear, Interpolation::bicubic}) {
+            for (double angle : {BENCH_ANGLE, -15.0, 0.5}) {
+                std::ostringstream name;
+                name << simd_level_name(level) << "-" << interpolation_name(interpolation) << "/" << angle << "deg";
+                auto rotate_at = [interpolation, angle](SimdLevel at) {
+                    return [interpolation, angle, at](const Image& s) {
+                        return rotate_at_level(at, [&]() { return rotate_image_fixed(s, angle, interpolation); });
+                    };
+                };
+                checks.push_back({name.str(), rotate_at(level), rotate_at(SimdLevel::scalar)});
+            }
+        }
+    }
+
+    int failures = 0;
+    for (const BenchSize& size : options.sizes) {
+        Image source = make_synthetic(size);
+        for (SourceFormat format : options.formats) {
+            Image decoded = convert_to(source, format);
+            Image converted;
+            const Image& source_rgba = rgba_source(decoded, converted);
+            for (const Check& check : checks) {
+                Image rotated = check.rotate(decoded);
+                Image reference = check.expected ? check.expected(decoded) : Image();
+                const Image& expected = check.expected ? reference : source_rgba;
+                std::string key = "check/" + check.name + "/" + format_name(format) + "/" + size_name(size);
+                std::cout << std::left << std::setw(44) << key << std::right;
+                if (rotated.width != expected.width || rotated.height != expected.height) {
+                    std::cout << "  FAILED: " << rotated.width << "x" << rotated.height << std::endl;
+                    ++failures;
+                } else if (int differences = count_differences(rotated, expected, static_cast<bool>(check.expected))) {
+                    std::cout << "  FAILED: " << differences << " pixels differ" << std::endl;
+                    ++failures;
+                } else {
+                    std::cout << "  ok" << std::endl;
+                }
+            }
+        }
+    }
+    return failures;
+}
+
+void save_results(const std::string& path, const std::vector<BenchResult>& results) {
+    std::ofstream out(path);
+    for (const auto& r : results) {
+        out << r.key << " " << r.mpix_per_second << "\n";
+    }
+    if (!out)
+        throw std::runtime_error("Could not write " + path);
+}
+
+// Compare MPix/s against a saved run. Returns the number of regressions.
+int compare_results(const std::string& path, const std::vector<BenchResult>& results, double tolerance) {
+    std::ifstream in(path);
+    if (!in)
+        throw std::runtime_error("Could not read " + path);
+    std::map<std::string, double> baseline;
+    std::string key;
+    double rate;
+    while (in >> key >> rate) {
+        baseline[key] = rate;
+    }
+
+    int regressions = 0;
+    std::cout << "== compared with " << path << " (tolerance " << tolerance << "%)" << std::endl;
+    for (const auto& r : results) {
+        auto it = baseline.find(r.key);
+        if (it == baseline.end() || it->second <= 0.0)
+            continue;
+        double change = 100.0 * (r.mpix_per_second / it->second - 1.0);
+        bool regressed = change < -tolerance;
+        regressions += regressed;
+        std::cout << std::left << std::setw(44) << r.key << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(10) << it->second << " -> " << std::setw(8) << r.mpix_per_second << " MPix/s "
+                  << std::showpos << std::setw(7) << change << "%" << std::noshowpos
+                  << (regressed ? "  REGRESSION" : "") << std::endl;
+    }
+    return regressions;
+}
+
+template <typename T, typename Parse>
+bool parse_list(const std::string& text, std::vector<T>& out, Parse&& parse) {
+    out.clear();
+    std::stringstream in(text);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        T value;
+        if (!parse(item, value))
+            return false;
+        out.push_back(value);
+    }
+    return !out.empty();
+}
+
+bool parse_bench_option(BenchOptions& options, const std::string& arg) {
+    auto value = [&arg](size_t prefix) { return arg.substr(prefix); };
+    try {
+        if (arg.rfind("--sizes=", 0) == 0) {
+            return parse_list(value(8), options.sizes, [](const std::string& s, BenchSize& size) {
+                char extra;
+                return std::sscanf(s.c_str(), "%dx%d%c", &size.width, &size.height, &extra) == 2 &&
+                       size.width > 0 && size.height > 0;
+            });
+        }
+        if (arg.rfind("--formats=", 0) == 0)
+            return parse_list(value(10), options.formats, parse_format);
+        if (arg.rfind("--kernels=", 0) == 0) {
+            return parse_list(value(10), options.kernels, [](const std::string& s, std::string& name) {
+                name = s;
+                return !s.empty();
+            });
+        }
+        if (arg.rfind("--threads=", 0) == 0) {
+            return parse_list(value(10), options.threads, [](const std::string& s, int& n) {
+                n = std::stoi(s);
+                return n > 0;
+            });
+        }
+        if (arg.rfind("--files=", 0) == 0) {
+            options.files = std::stoi(value(8));
+            return options.files > 0;
+        }
+        if (arg.rfind("--min-time=", 0) == 0) {
+            options.min_time = std::stod(value(11));
+            return options.min_time >= 0.0;
+        }
+        if (arg.rfind("--tolerance=", 0) == 0) {
+            options.tolerance = std::stod(value(12));
+            return options.tolerance >= 0.0;
+        }
+    } catch (const std::exception&) {
+        return false;
+    }
+    if (arg.rfind("--save=", 0) == 0) {
+        options.save = value(7);
+        return !options.save.empty();
+    }
+    if (arg.rfind("--compare=", 0) == 0) {
+        options.compare = value(10);
+        return !options.compare.empty();
+    }
+    if (arg.rfind("--simd=", 0) == 0)
+        return parse_simd_level(value(7), active_simd_level);
+    if (arg == "--check") {
+        options.check = true;
+        return true;
+    }
+    return false;
+}
+
+int main(int argc, char* argv[]) {
+    BenchOptions options;
+    for (int i = 1; i < argc; ++i) {
+        if (!parse_bench_option(options, argv[i])) {
+            std::cerr << "Usage: " << argv[0] << " [--sizes=WxH,...] [--formats=rgba,rgb,gray,palette,rgba16]"
+                      << " [--kernels=NAME,...] [--threads=N,...] [--files=N] [--min-time=SECONDS]"
+                      << " [--save=FILE] [--compare=FILE] [--tolerance=PERCENT] [--simd=auto|scalar|sse2|avx2|avx512]"
+                      << " [--check]" << std::endl << "kernels: v2-stream";
+            for (const BenchKernel& kernel : all_kernels()) {
+                std::cerr << " " << kernel.name;
+            }
+            std::cerr << std::endl;
+            return 1;
+        }
+    }
+    if (options.threads.empty()) {
+        int cores = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+        for (int n = 1; n < cores; n *= 2) {
+            options.threads.push_back(n);
+        }
+        options.threads.push_back(cores);
+    }
+
+    if (options.check) {
+        int failures = run_checks(options);
+        if (failures > 0) {
+            std::cout << failures << " check(s) failed" << std::endl;
+            return 2;
+        }
+        return 0;
+    }
+
+    std::vector<BenchResult> results;
+    int regressions = 0;
+    try {
+        run_benchmarks(options, results);
+        if (!options.save.empty())
+            save_results(options.save, results);
+        if (!options.compare.empty())
+            regressions = compare_results(options.compare, results, options.tolerance);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        return 1;
+    }
+    if (regressions > 0) {
+        std::cout << regressions << " regression(s)" << std::endl;
+        return 2;
+    }
+    return 0;
+}
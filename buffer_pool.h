@@ -0,0 +1,182 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+// Pixel and file buffers are recycled instead of going back to the allocator.
+// glibc serves large blocks with mmap, so every image used to cost a fresh
+// mapping, its page faults and an munmap, and with many threads the unmaps
+// serialize on the address space of the process. A released buffer is kept in
+// a small cache of its thread, where the next image on that thread picks it up
+// without a lock; only buffers that move between threads (the stages of
+// --pipeline) or overflow a thread's cache go through the shared depot.
+
+// every pooled buffer starts on this boundary
+constexpr size_t BUFFER_ALIGNMENT = 64;
+
+// buffers a thread keeps for itself
+constexpr int THREAD_CACHED_BUFFERS = 4;
+
+// the shared depot holds at most this many buffers and bytes
+constexpr size_t SHARED_CACHED_BUFFERS = 64;
+constexpr size_t SHARED_CACHED_BYTES = size_t(512) << 20;
+
+struct PooledBuffer {
+    unsigned char* data = nullptr;
+    size_t capacity = 0;
+};
+
+// index of the smallest of count buffers that holds bytes, or -1
+inline int best_fit(const PooledBuffer* buffers, size_t count, size_t bytes) {
+    int best = -1;
+    for (size_t i = 0; i < count; ++i) {
+        if (buffers[i].capacity >= bytes && (best < 0 || buffers[i].capacity < buffers[best].capacity))
+            best = static_cast<int>(i);
+    }
+    return best;
+}
+
+inline size_t smallest_buffer(const PooledBuffer* buffers, size_t count) {
+    size_t smallest = 0;
+    for (size_t i = 1; i < count; ++i) {
+        if (buffers[i].capacity < buffers[smallest].capacity)
+            smallest = i;
+    }
+    return smallest;
+}
+
+class BufferPool {
+public:
+    BufferPool() { shared.reserve(SHARED_CACHED_BUFFERS); }
+    ~BufferPool() {
+        for (const PooledBuffer& buffer : shared) {
+            std::free(buffer.data);
+        }
+    }
+
+    // an aligned buffer of at least bytes (> 0), contents undefined
+    PooledBuffer acquire(size_t bytes) {
+        if (ThreadCache* cache = local()) {
+            int i = best_fit(cache->buffers, cache->count, bytes);
+            if (i >= 0) {
+                reuse_count.fetch_add(1, std::memory_order_relaxed);
+                PooledBuffer buffer = cache->buffers[i];
+                cache->buffers[i] = cache->buffers[--cache->count];
+                return buffer;
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            int i = best_fit(shared.data(), shared.size(), bytes);
+            if (i >= 0) {
+                reuse_count.fetch_add(1, std::memory_order_relaxed);
+                PooledBuffer buffer = shared[i];
+                shared_bytes -= buffer.capacity;
+                shared[i] = shared.back();
+                shared.pop_back();
+                return buffer;
+            }
+        }
+
+        // whole pages, so slightly larger images of the same size class still fit
+        size_t capacity = (bytes + 4095) / 4096 * 4096;
+        unsigned char* p = static_cast<unsigned char*>(std::aligned_alloc(BUFFER_ALIGNMENT, capacity));
+        if (!p)
+            throw std::bad_alloc();
+        allocation_count.fetch_add(1, std::memory_order_relaxed);
+        return {p, capacity};
+    }
+
+    // keep buffer for a later acquire; the smallest buffers are dropped first
+    void release(PooledBuffer buffer) {
+        ThreadCache* cache = local();
+        if (cache) {
+            if (cache->count < THREAD_CACHED_BUFFERS) {
+                cache->buffers[cache->count++] = buffer;
+                return;
+            }
+            PooledBuffer& smallest = cache->buffers[smallest_buffer(cache->buffers, cache->count)];
+            if (smallest.capacity < buffer.capacity)
+                std::swap(smallest, buffer);
+        }
+        share(buffer);
+    }
+
+    uint64_t reused() const { return reuse_count.load(); }
+    uint64_t allocations() const { return allocation_count.load(); }
+
+private:
+    struct ThreadCache {
+        PooledBuffer buffers[THREAD_CACHED_BUFFERS];
+        size_t count = 0;
+
+        // a finished thread leaves its buffers to the others
+        ~ThreadCache();
+    };
+
+    // this thread's cache, or nullptr while the thread is shutting down
+    static ThreadCache* local() {
+        thread_local bool gone = false;
+        if (gone)
+            return nullptr;
+        thread_local struct Owner {
+            ThreadCache cache;
+            ~Owner() { gone = true; }
+        } owner;
+        return &owner.cache;
+    }
+
+    void share(PooledBuffer buffer) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (shared.size() < SHARED_CACHED_BUFFERS && shared_bytes + buffer.capacity <= SHARED_CACHED_BYTES) {
+                shared.push_back(buffer);
+                shared_bytes += buffer.capacity;
+                return;
+            }
+        }
+        std::free(buffer.data);
+    }
+
+    std::mutex mutex;
+    std::vector<PooledBuffer> shared;
+    size_t shared_bytes = 0;
+    std::atomic<uint64_t> reuse_count{0};
+    std::atomic<uint64_t> allocation_count{0};
+};
+
+inline BufferPool buffer_pool;
+
+inline BufferPool::ThreadCache::~ThreadCache() {
+    for (size_t i = 0; i < count; ++i) {
+        buffer_pool.share(buffers[i]);
+    }
+}
+
+// owner of a pooled buffer that hands it back when done
+struct PoolRelease {
+    size_t capacity = 0;
+    void operator()(unsigned char* p) const { buffer_pool.release({p, capacity}); }
+};
+
+using PooledBytes = std::unique_ptr<unsigned char, PoolRelease>;
+
+inline PooledBytes acquire_bytes(size_t bytes) {
+    PooledBuffer buffer = buffer_pool.acquire(bytes);
+    return PooledBytes(buffer.data, PoolRelease{buffer.capacity});
+}
+
+inline void print_buffer_pool_stats(std::ostream& out) {
+    uint64_t reused = buffer_pool.reused();
+    uint64_t allocations = buffer_pool.allocations();
+    out << "buffer pool: " << reused + allocations << " buffers, " << reused << " reused, " << allocations
+        << " allocated" << std::endl;
+}
@@ -0,0 +1,532 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "encode_profile.h"
+#include "fanout.h"
+#include "file_io.h"
+#include "journal.h"
+#include "metrics.h"
+
+namespace fs = std::filesystem;
+
+// Datasets often hold many byte-identical PNGs (copies made to fill a test
+// set, the same asset in several folders). With --dedup, each output is
+// remembered under a hash of the input bytes and of the transform that made
+// it, and a repeated input is answered by writing the remembered bytes, with
+// no decode, rotation or encode. The cache lives in memory for one batch, or
+// with --dedup-dir in a folder of encoded outputs that later runs reuse; those
+// are hard-linked to and from the outputs where the file system allows.
+
+struct ContentHash {
+    uint64_t low = 0;
+    uint64_t high = 0;
+};
+
+inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+// MurmurHash3 x64_128 of size bytes; several GB/s, so hashing an input costs
+// far less than decoding it
+inline ContentHash murmur3_128(const void* key, size_t size, uint64_t seed = 0) {
+    constexpr uint64_t c1 = 0x87c37b91114253d5ULL;
+    constexpr uint64_t c2 = 0x4cf5ad432745937fULL;
+    const unsigned char* data = static_cast<const unsigned char*>(key);
+    const size_t blocks = size / 16;
+    uint64_t h1 = seed;
+    uint64_t h2 = seed;
+
+    for (size_t i = 0; i < blocks; ++i) {
+        uint64_t k1, k2;
+        std::memcpy(&k1, data + i * 16, 8);
+        std::memcpy(&k2, data + i * 16 + 8, 8);
+        k1 *= c1;
+        k1 = rotl64(k1, 31);
+        k1 *= c2;
+        h1 ^= k1;
+        h1 = rotl64(h1, 27);
+        h1 += h2;
+        h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2;
+        k2 = rotl64(k2, 33);
+        k2 *= c1;
+        h2 ^= k2;
+        h2 = rotl64(h2, 31);
+        h2 += h1;
+        h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    const unsigned char* tail = data + blocks * 16;
+    const size_t rest = size & 15;
+    uint64_t k1 = 0;
+    uint64_t k2 = 0;
+    for (size_t i = rest; i > 8; --i) {
+        k2 ^= static_cast<uint64_t>(tail[i - 1]) << ((i - 9) * 8);
+    }
+    if (rest > 8) {
+        k2 *= c2;
+        k2 = rotl64(k2, 33);
+        k2 *= c1;
+        h2 ^= k2;
+    }
+    for (size_t i = std::min<size_t>(rest, 8); i > 0; --i) {
+        k1 ^= static_cast<uint64_t>(tail[i - 1]) << ((i - 1) * 8);
+    }
+    if (rest > 0) {
+        k1 *= c1;
+        k1 = rotl64(k1, 31);
+        k1 *= c2;
+        h1 ^= k1;
+    }
+
+    h1 ^= size;
+    h2 ^= size;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+    return {h1, h2};
+}
+
+// Part of every transform hash; change it when the encoded output of a
+// transform changes, so that a --dedup-dir written by an older build is not
+// taken for current results.
+constexpr const char* DEDUP_FORMAT = "rotate-dedup-1";
+
+// Hash of what an output depends on besides the input bytes: the transform
+// (RotationOutput::transform) and the encoder profile.
+inline uint64_t transform_hash(const std::string& transform) {
+    std::string description = std::string(DEDUP_FORMAT) + "\n" + transform + "\n" +
+                              encode_profile_name(active_encode_profile);
+    return murmur3_128(description.data(), description.size()).low;
+}
+
+// <32 hex digits of the input hash>-<16 of the transform hash>.png
+constexpr size_t DEDUP_NAME_LENGTH = 53;
+
+// one cached output
+struct DedupKey {
+    ContentHash input;
+    uint64_t transform = 0;
+
+    // name of the output in a --dedup-dir
+    std::string file_name() const {
+        char name[64];
+        std::snprintf(name, sizeof(name), "%016llx%016llx-%016llx.png", static_cast<unsigned long long>(input.high),
+                      static_cast<unsigned long long>(input.low), static_cast<unsigned long long>(transform));
+        return name;
+    }
+};
+
+// a cached output found by lookup: its bytes in memory, or its file in the
+// cache folder, kept open so that eviction cannot take it away before it is
+// written
+class CachedOutput {
+public:
+    CachedOutput() = default;
+    ~CachedOutput() {
+        if (fd >= 0)
+            ::close(fd);
+    }
+    CachedOutput(CachedOutput&& other) noexcept { *this = std::move(other); }
+    CachedOutput& operator=(CachedOutput&& other) noexcept {
+        if (this != &other) {
+            if (fd >= 0)
+                ::close(fd);
+            bytes = std::move(other.bytes);
+            file = std::move(other.file);
+            fd = std::exchange(other.fd, -1);
+            size = other.size;
+        }
+        return *this;
+    }
+    CachedOutput(const CachedOutput&) = delete;
+    CachedOutput& operator=(const CachedOutput&) = delete;
+
+    std::shared_ptr<const std::vector<unsigned char>> bytes;
+    fs::path file;
+    int fd = -1;
+    size_t size = 0;
+};
+
+// read the whole of an open file
+inline std::vector<unsigned char> read_open_file(int fd, size_t size, const fs::path& path) {
+    std::vector<unsigned char> bytes(size);
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = ::pread(fd, bytes.data() + done, size - done, static_cast<off_t>(done));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n == 0)
+            throw file_error("Could not read file", path.c_str(), "unexpected end of file");
+        if (n < 0)
+            throw file_error("Could not read file", path.c_str());
+        done += static_cast<size_t>(n);
+    }
+    return bytes;
+}
+
+// Encoded outputs by input content and transform. In memory, least recently
+// used outputs are dropped beyond the capacity; with a folder, its files are
+// the cache and the capacity bounds their total size. The folder is indexed
+// when the batch starts, least recently used first by modification time, and
+// a hit touches its file.
+class DedupCache {
+public:
+    DedupCache(size_t capacity, fs::path dir = fs::path()) : capacity(capacity), dir(std::move(dir)) {}
+
+    // Index the outputs in the cache folder and remove temp files a crash left
+    // there; other files are left alone. A folder serves one batch at a time.
+    void open() {
+        if (dir.empty())
+            return;
+        fs::create_directories(dir);
+        std::vector<std::pair<fs::file_time_type, Entry>> found;
+        for (const fs::directory_entry& item : fs::directory_iterator(dir)) {
+            if (!item.is_regular_file())
+                continue;
+            std::string name = item.path().filename().string();
+            if (name.size() < DEDUP_NAME_LENGTH || name[32] != '-' || name.compare(49, 4, ".png") != 0)
+                continue;
+            if (name.size() > DEDUP_NAME_LENGTH) {
+                if (name.compare(DEDUP_NAME_LENGTH, 5, ".tmp.") == 0) {
+                    std::error_code ec;
+                    fs::remove(item.path(), ec);
+                }
+                continue;
+            }
+            found.push_back({item.last_write_time(), Entry{name, static_cast<size_t>(item.file_size()), nullptr}});
+        }
+        // oldest first, so the newest ends up in front
+        std::sort(found.begin(), found.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& item : found) {
+            add(std::move(item.second));
+        }
+        evict();
+    }
+
+    // the cached output for key, or false
+    bool lookup(const DedupKey& key, CachedOutput& cached) {
+        std::string name = key.file_name();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = index.find(name);
+            if (it == index.end())
+                return false;
+            entries.splice(entries.begin(), entries, it->second);
+            if (dir.empty()) {
+                cached.bytes = it->second->bytes;
+                cached.size = cached.bytes->size();
+                return true;
+            }
+        }
+        cached.file = dir / name;
+        cached.fd = ::open(cached.file.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (cached.fd < 0 || ::fstat(cached.fd, &st) != 0) {
+            forget(name);  // removed behind our back
+            return false;
+        }
+        cached.size = static_cast<size_t>(st.st_size);
+        ::futimens(cached.fd, nullptr);
+        return true;
+    }
+
+    // Remember the encoded output for key, or the output that was just
+    // written to path (as a link to it where possible). An output that cannot
+    // be cached is reported; the output itself is fine.
+    void store(const DedupKey& key, const std::vector<unsigned char>& bytes) {
+        try {
+            store_bytes(key.file_name(), bytes);
+        } catch (const std::exception& e) {
+            report_store_failure(key, e);
+        }
+    }
+
+    void store_file(const DedupKey& key, const fs::path& path) {
+        try {
+            store_written(key.file_name(), path);
+        } catch (const std::exception& e) {
+            report_store_failure(key, e);
+        }
+    }
+
+    // Write a looked-up output to path like any other output (replace_file):
+    // a link to the cache file where possible, a copy of the bytes otherwise.
+    void write(const CachedOutput& cached, const fs::path& path) {
+        replace_file(path, [&](const fs::path& temp) {
+            if (cached.bytes) {
+                write_file(temp.c_str(), *cached.bytes);
+                return;
+            }
+            ::unlink(temp.c_str());
+            if (::link(cached.file.c_str(), temp.c_str()) == 0) {
+                count(Counter::bytes_out, cached.size);
+                return;
+            }
+            write_file(temp.c_str(), read_open_file(cached.fd, cached.size, cached.file));
+        });
+        reused_bytes.fetch_add(cached.size, std::memory_order_relaxed);
+    }
+
+    void count_hits(size_t n) { hit_count.fetch_add(n, std::memory_order_relaxed); }
+    void count_misses(size_t n) { miss_count.fetch_add(n, std::memory_order_relaxed); }
+
+    uint64_t hits() const { return hit_count.load(); }
+    uint64_t misses() const { return miss_count.load(); }
+    uint64_t reused() const { return reused_bytes.load(); }
+    const fs::path& folder() const { return dir; }
+
+    size_t cached_bytes() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return used;
+    }
+
+    size_t cached_outputs() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return entries.size();
+    }
+
+private:
+    struct Entry {
+        std::string name;  // DedupKey::file_name
+        size_t size;
+        std::shared_ptr<const std::vector<unsigned char>> bytes;  // in memory only
+    };
+
+    void store_bytes(const std::string& name, const std::vector<unsigned char>& bytes) {
+        if (bytes.size() > capacity)
+            return;
+        if (dir.empty()) {
+            insert(Entry{name, bytes.size(), std::make_shared<const std::vector<unsigned char>>(bytes)});
+            return;
+        }
+        fs::path temp = unique_temp(name);
+        try {
+            write_file(temp.c_str(), bytes);
+        } catch (const std::exception&) {
+            std::error_code ec;
+            fs::remove(temp, ec);
+            throw;
+        }
+        fs::rename(temp, dir / name);
+        insert(Entry{name, bytes.size(), nullptr});
+    }
+
+    void store_written(const std::string& name, const fs::path& path) {
+        if (!dir.empty()) {
+            struct stat st;
+            if (::stat(path.c_str(), &st) != 0 || static_cast<size_t>(st.st_size) > capacity)
+                return;
+            if (::link(path.c_str(), (dir / name).c_str()) == 0 || errno == EEXIST) {
+                insert(Entry{name, static_cast<size_t>(st.st_size), nullptr});
+                return;
+            }
+        }
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || ::fstat(fd, &st) != 0) {
+            if (fd >= 0)
+                ::close(fd);
+            throw file_error("Could not open file", path.c_str());
+        }
+        std::vector<unsigned char> bytes;
+        try {
+            bytes = read_open_file(fd, static_cast<size_t>(st.st_size), path);
+        } catch (...) {
+            ::close(fd);
+            throw;
+        }
+        ::close(fd);
+        store_bytes(name, bytes);
+    }
+
+    static void report_store_failure(const DedupKey& key, const std::exception& e) {
+        std::cerr << "Could not add " << key.file_name() << " to the dedup cache: " << e.what() << std::endl;
+    }
+
+    fs::path unique_temp(const std::string& name) {
+        static std::atomic<uint64_t> serial{0};
+        return dir / (name + ".tmp." + std::to_string(::getpid()) + "." + std::to_string(serial.fetch_add(1)));
+    }
+
+    void insert(Entry entry) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(entry.name);
+        if (it != index.end()) {
+            entries.splice(entries.begin(), entries, it->second);
+            return;
+        }
+        add(std::move(entry));
+        evict();
+    }
+
+    // as the most recently used, with the lock held
+    void add(Entry entry) {
+        used += entry.size;
+        entries.push_front(std::move(entry));
+        index[entries.front().name] = entries.begin();
+    }
+
+    void forget(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(name);
+        if (it == index.end())
+            return;
+        used -= it->second->size;
+        entries.erase(it->second);
+        index.erase(it);
+    }
+
+    // drop least recently used outputs until the cache fits, with the lock held
+    void evict() {
+        while (used > capacity && !entries.empty()) {
+            const Entry& oldest = entries.back();
+            if (!dir.empty()) {
+                std::error_code ec;
+                fs::remove(dir / oldest.name, ec);
+            }
+            used -= oldest.size;
+            index.erase(oldest.name);
+            entries.pop_back();
+        }
+    }
+
+    std::mutex mutex;
+    size_t capacity;
+    fs::path dir;
+    size_t used = 0;
+    std::list<Entry> entries;  // most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    std::atomic<uint64_t> hit_count{0};
+    std::atomic<uint64_t> miss_count{0};
+    std::atomic<uint64_t> reused_bytes{0};
+};
+
+// cache of the running batch, if any
+inline DedupCache* active_dedup = nullptr;
+
+// the cache key of every output of an input with the given contents
+inline std::vector<DedupKey> dedup_keys(const unsigned char* data, size_t size,
+                                        const std::vector<RotationOutput>& outputs) {
+    ContentHash input = murmur3_128(data, size);
+    std::vector<DedupKey> keys;
+    for (const RotationOutput& output : outputs) {
+        keys.push_back(DedupKey{input, transform_hash(output.transform)});
+    }
+    return keys;
+}
+
+// Write every output of input from the cache if all of them are in it.
+// Returns false, having written nothing, if any one is missing.
+inline bool write_cached_outputs(const fs::path& input, const std::vector<RotationOutput>& outputs,
+                                 const std::vector<DedupKey>& keys) {
+    std::vector<CachedOutput> cached(outputs.size());
+    for (size_t i = 0; i < outputs.size(); ++i) {
+        if (!active_dedup->lookup(keys[i], cached[i]))
+            return false;
+    }
+    for (size_t i = 0; i < outputs.size(); ++i) {
+        active_dedup->write(cached[i], output_path_for(input, outputs[i]));
+    }
+    active_dedup->count_hits(outputs.size());
+    return true;
+}
+
+// identity of the file at path, to tell whether replace_file put a new one there
+inline bool file_identity(const fs::path& path, ino_t& inode, dev_t& device) {
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0)
+        return false;
+    inode = st.st_ino;
+    device = st.st_dev;
+    return true;
+}
+
+// process input, unless its outputs can be written from the cache; afterwards
+// the outputs process wrote are added to the cache
+inline void process_deduplicated(const fs::path& input, const std::vector<RotationOutput>& outputs,
+                                 const std::function<void(const fs::path&)>& process) {
+    std::vector<DedupKey> keys;
+    {
+        int fd = ::open(input.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            throw file_error("Could not open file", input.c_str());
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw file_error("Could not stat file", input.c_str());
+        }
+        size_t size = static_cast<size_t>(st.st_size);
+        void* p = size > 0 ? ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+        ::close(fd);
+        if (p == MAP_FAILED)
+            throw file_error("Could not map file", input.c_str());
+        keys = dedup_keys(static_cast<const unsigned char*>(p), size, outputs);
+        if (p)
+            ::munmap(p, size);
+        if (write_cached_outputs(input, outputs, keys)) {
+            count(Counter::bytes_in, size);
+            return;
+        }
+    }
+
+    // replace_file renames a new file over every output it writes, so an
+    // output with the same inode as before was not written (it failed)
+    std::vector<std::pair<ino_t, dev_t>> before(outputs.size(), {0, 0});
+    for (size_t i = 0; i < outputs.size(); ++i) {
+        file_identity(output_path_for(input, outputs[i]), before[i].first, before[i].second);
+    }
+    process(input);
+    active_dedup->count_misses(outputs.size());
+    for (size_t i = 0; i < outputs.size(); ++i) {
+        fs::path path = output_path_for(input, outputs[i]);
+        ino_t inode;
+        dev_t device;
+        if (!file_identity(path, inode, device) || (inode == before[i].first && device == before[i].second))
+            continue;
+        active_dedup->store_file(keys[i], path);
+    }
+}
+
+inline void print_dedup_stats(std::ostream& out, DedupCache& cache) {
+    out << "dedup: " << cache.hits() << " hits, " << cache.misses() << " misses, " << cache.reused() / 1e6
+        << " MB reused, " << cache.cached_outputs() << " outputs (" << cache.cached_bytes() / 1e6 << " MB)";
+    if (!cache.folder().empty())
+        out << " in " << cache.folder();
+    out << std::endl;
+}
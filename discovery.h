@@ -0,0 +1,162 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include "thread_pool.h"
+
+namespace fs = std::filesystem;
+
+// which files under the input folder are images to process
+struct DiscoveryOptions {
+    bool recursive = false;                        // descend into subfolders
+    std::vector<std::string> extensions = {".png"};  // matched case-sensitively
+};
+
+// Parse a comma-separated extension list such as "png,PNG" or ".png".
+inline bool parse_extensions(const std::string& spec, std::vector<std::string>& extensions) {
+    extensions.clear();
+    std::stringstream in(spec);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        if (item.empty() || item == ".")
+            return false;
+        extensions.push_back(item[0] == '.' ? item : "." + item);
+    }
+    return !extensions.empty() && spec.back() != ',';
+}
+
+inline bool has_image_extension(const fs::path& path, const DiscoveryOptions& options) {
+    std::string extension = path.extension().string();
+    return std::find(options.extensions.begin(), options.extensions.end(), extension) != options.extensions.end();
+}
+
+// files a folder task hands out before it helps process them, so a huge
+// folder cannot queue millions of tasks ahead of the workers
+constexpr size_t DISCOVERY_MAX_QUEUED = 4096;
+
+// state shared by the folder tasks of one walk
+struct DiscoveryWalk {
+    ThreadPool& pool;
+    DiscoveryOptions options;
+    std::function<void(const fs::path&)> found;
+};
+
+// Walk one folder. Every subfolder (with options.recursive) becomes a task of
+// its own as soon as it is seen, so separate shards are listed in parallel.
+// The images of the folder go to found once its listing is complete: files
+// are replaced through renames in their own folder, and a listing still open
+// while that happens may return a name twice. Symlinked folders are not
+// followed.
+inline void discover_folder(const std::shared_ptr<DiscoveryWalk>& walk, const fs::path& folder) {
+    std::vector<fs::path> images;
+    std::error_code ec;
+    fs::directory_iterator it(folder, ec);
+    for (; !ec && it != fs::directory_iterator(); it.increment(ec)) {
+        const fs::directory_entry& entry = *it;
+        std::error_code type_ec;
+        bool subfolder = !entry.is_symlink(type_ec) && entry.is_directory(type_ec);
+        if (subfolder) {
+            if (walk->options.recursive) {
+                fs::path sub = entry.path();
+                walk->pool.submit([walk, sub]() { discover_folder(walk, sub); });
+            }
+        } else if (has_image_extension(entry.path(), walk->options)) {
+            images.push_back(entry.path());
+        }
+    }
+    if (ec)
+        std::cerr << "Error scanning " << folder << ": " << ec.message() << std::endl;
+
+    for (const auto& path : images) {
+        walk->found(path);
+        while (walk->pool.queued() > DISCOVERY_MAX_QUEUED && walk->pool.run_pending_task()) {
+        }
+    }
+}
+
+// Start walking root on the pool and return. found is called on the pool
+// threads for every image as it is found; once pool.wait_idle() returns the
+// whole tree has been seen.
+inline void discover_images(ThreadPool& pool, const fs::path& root, const DiscoveryOptions& options,
+                            std::function<void(const fs::path&)> found) {
+    auto walk = std::make_shared<DiscoveryWalk>(DiscoveryWalk{pool, options, std::move(found)});
+    pool.submit([walk, root]() { discover_folder(walk, root); });
+}
+
+// Paths in the order they were found, for consumers that take them by index
+// while discovery is still adding more (the pipeline's read stage).
+class PathStream {
+public:
+    // returns the index of path
+    size_t push(fs::path path) {
+        size_t k;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            k = paths.size();
+            paths.push_back(std::move(path));
+        }
+        grown.notify_all();
+        return k;
+    }
+
+    // no more paths will be pushed
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+        }
+        grown.notify_all();
+    }
+
+    // path k, waiting until it is found; false if the stream ends before it
+    bool wait(size_t k, fs::path& path) {
+        std::unique_lock<std::mutex> lock(mutex);
+        grown.wait(lock, [&]() { return k < paths.size() || closed; });
+        if (k >= paths.size())
+            return false;
+        path = paths[k];
+        return true;
+    }
+
+    // path k if it has been found already
+    bool try_get(size_t k, fs::path& path) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (k >= paths.size())
+            return false;
+        path = paths[k];
+        return true;
+    }
+
+    // true once the stream is closed with fewer than k + 1 paths
+    bool ended_before(size_t k) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return closed && k >= paths.size();
+    }
+
+    // for Prefetcher
+    size_t size() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return paths.size();
+    }
+    fs::path operator[](size_t k) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return paths[k];
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable grown;
+    std::deque<fs::path> paths;
+    bool closed = false;
+};
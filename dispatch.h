@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cmath>
+
+#include "image.h"
+#include "transpose.h"
+
+// A requested rotation: a clockwise angle, or one of the lossless orientations.
+struct Transform {
+    bool oriented = false;
+    Orientation orientation = Orientation::identity;
+    double angle = 0.0;  // clockwise, in degrees; unused when oriented
+};
+
+inline Transform rotation_by(double angle_degrees) {
+    Transform t;
+    t.angle = angle_degrees;
+    return t;
+}
+
+inline Transform oriented(Orientation orientation) {
+    Transform t;
+    t.oriented = true;
+    t.orientation = orientation;
+    return t;
+}
+
+// Exact multiples of 90 degrees (including 0, -90 or 450) become orientations;
+// every other angle is left for an arbitrary-angle engine.
+inline Transform classify_transform(const Transform& transform) {
+    if (transform.oriented || !std::isfinite(transform.angle))
+        return transform;
+    double turn = std::fmod(transform.angle, 360.0);  // exact
+    if (std::fmod(turn, 90.0) != 0.0)
+        return transform;
+    int quarter_turns = (static_cast<int>(turn / 90.0) + 4) % 4;
+    static const Orientation by_quarter_turns[] = {Orientation::identity, Orientation::rotate_90,
+                                                   Orientation::rotate_180, Orientation::rotate_270};
+    return oriented(by_quarter_turns[quarter_turns]);
+}
+
+// Unified rotation entry point. Right angles and flips run on the lossless,
+// per-orientation specialized kernels of transpose.h, so they come out exact
+// instead of going through trigonometry and truncation; only true arbitrary
+// angles are handed to arbitrary(image, angle_degrees).
+template <typename Arbitrary>
+inline Image rotate_transform(const Image& image_data, const Transform& transform, Arbitrary&& arbitrary) {
+    Transform t = classify_transform(transform);
+    if (t.oriented)
+        return orient_image(image_data, t.orientation);
+    return arbitrary(image_data, t.angle);
+}
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <png.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+
+#include "image.h"
+
+// PNG encoder settings, traded between speed and output size
+enum class EncodeProfile {
+    standard,  // libpng defaults: every filter tried per row, zlib level 6
+    fastest,
+    balanced,
+    smallest,
+    adaptive,  // picked per image from a sample of its rows
+};
+
+inline bool parse_encode_profile(const std::string& name, EncodeProfile& profile) {
+    if (name == "default") {
+        profile = EncodeProfile::standard;
+    } else if (name == "fastest") {
+        profile = EncodeProfile::fastest;
+    } else if (name == "balanced") {
+        profile = EncodeProfile::balanced;
+    } else if (name == "smallest") {
+        profile = EncodeProfile::smallest;
+    } else if (name == "adaptive") {
+        profile = EncodeProfile::adaptive;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+inline const char* encode_profile_name(EncodeProfile profile) {
+    switch (profile) {
+    case EncodeProfile::fastest:
+        return "fastest";
+    case EncodeProfile::balanced:
+        return "balanced";
+    case EncodeProfile::smallest:
+        return "smallest";
+    case EncodeProfile::adaptive:
+        return "adaptive";
+    default:
+        return "default";
+    }
+}
+
+// profile used by write_png_file and the pipeline, set from --encode=
+inline EncodeProfile active_encode_profile = EncodeProfile::standard;
+
+struct EncodeSettings {
+    bool use_defaults = true;  // leave libpng alone, the remaining fields are unused
+    int level = Z_DEFAULT_COMPRESSION;
+    int strategy = Z_DEFAULT_STRATEGY;
+    int window_bits = 15;
+    int mem_level = 8;
+    int filters = PNG_ALL_FILTERS;  // PNG_FILTER_* mask; libpng picks per row among them
+};
+
+inline EncodeSettings make_settings(int level, int strategy, int window_bits, int mem_level, int filters) {
+    EncodeSettings s;
+    s.use_defaults = false;
+    s.level = level;
+    s.strategy = strategy;
+    s.window_bits = window_bits;
+    s.mem_level = mem_level;
+    s.filters = filters;
+    return s;
+}
+
+// rows sampled by the adaptive profile
+constexpr int ADAPTIVE_SAMPLE_ROWS = 32;
+
+// Pick settings for one image from a sample of its rows: each PNG filter is
+// applied to the sampled rows and scored by the sum of absolute residuals
+// (the heuristic libpng itself uses per row), and the share of zero residuals
+// tells flat, synthetic content from photographic content. The best filter is
+// then used alone, which saves libpng from trying all five on every row.
+inline EncodeSettings adaptive_settings(const Image& image) {
+    const size_t bpp = image.pixel_bytes;
+    size_t row_bytes = static_cast<size_t>(image.width) * bpp;
+    uint64_t cost[5] = {0, 0, 0, 0, 0};  // none, sub, up, avg, paeth
+    uint64_t zeros[5] = {0, 0, 0, 0, 0};
+    uint64_t samples = 0;
+
+    int rows = std::min(image.height, ADAPTIVE_SAMPLE_ROWS);
+    for (int i = 0; i < rows; ++i) {
+        int y = static_cast<int>((static_cast<int64_t>(i) * image.height) / rows);
+        const unsigned char* cur = image.row(y);
+        const unsigned char* up = y > 0 ? image.row(y - 1) : nullptr;
+        for (size_t x = 0; x < row_bytes; ++x) {
+            int a = x >= bpp ? cur[x - bpp] : 0;
+            int b = up ? up[x] : 0;
+            int c = up && x >= bpp ? up[x - bpp] : 0;
+            int p = a + b - c;
+            int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+            int paeth = pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+            int predictions[5] = {0, a, b, (a + b) / 2, paeth};
+            for (int f = 0; f < 5; ++f) {
+                // residuals are bytes; score them as signed like libpng does
+                int r = static_cast<signed char>(static_cast<unsigned char>(cur[x] - predictions[f]));
+                cost[f] += static_cast<uint64_t>(std::abs(r));
+                zeros[f] += r == 0;
+            }
+        }
+        samples += row_bytes;
+    }
+
+    // indices and packed samples predict badly, PNG recommends no filter for them
+    bool unfiltered = image.format.layout == PixelLayout::palette || image.format.bit_depth < 8;
+    int best = 0;
+    for (int f = 1; f < 5 && !unfiltered; ++f) {
+        if (cost[f] < cost[best])
+            best = f;
+    }
+    static const int filter_masks[5] = {PNG_FILTER_NONE, PNG_FILTER_SUB, PNG_FILTER_UP, PNG_FILTER_AVG, PNG_FILTER_PAETH};
+
+    double zero_share = samples ? static_cast<double>(zeros[best]) / samples : 1.0;
+    if (zero_share > 0.6) {
+        // mostly flat: long runs, a quick level already finds them
+        return make_settings(2, Z_DEFAULT_STRATEGY, 15, 9, filter_masks[best]);
+    }
+    // photographic: small residuals, Huffman coding does most of the work
+    return make_settings(3, Z_FILTERED, 15, 9, filter_masks[best]);
+}
+
+inline EncodeSettings encode_settings(EncodeProfile profile, const Image& image) {
+    switch (profile) {
+    case EncodeProfile::fastest:
+        // one cheap filter and run-length matching only
+        return make_settings(1, Z_RLE, 15, 9, PNG_FILTER_SUB);
+    case EncodeProfile::balanced:
+        return make_settings(3, Z_FILTERED, 15, 9, PNG_FILTER_SUB | PNG_FILTER_UP | PNG_FILTER_PAETH);
+    case EncodeProfile::smallest:
+        return make_settings(9, Z_DEFAULT_STRATEGY, 15, 9, PNG_ALL_FILTERS);
+    case EncodeProfile::adaptive:
+        return adaptive_settings(image);
+    default:
+        return EncodeSettings();
+    }
+}
+
+inline void apply_encode_settings(png_structp png, const EncodeSettings& s) {
+    if (s.use_defaults)
+        return;
+    png_set_filter(png, PNG_FILTER_TYPE_BASE, s.filters);
+    png_set_compression_level(png, s.level);
+    png_set_compression_strategy(png, s.strategy);
+    png_set_compression_window_bits(png, s.window_bits);
+    png_set_compression_mem_level(png, s.mem_level);
+}
+
+// totals over every image encoded by this process
+struct EncodeStats {
+    std::atomic<uint64_t> images{0};
+    std::atomic<uint64_t> raw_bytes{0};  // pixel bytes handed to the encoder
+    std::atomic<uint64_t> png_bytes{0};
+    std::atomic<uint64_t> nanoseconds{0};
+};
+
+inline EncodeStats encode_stats;
+
+inline void print_encode_stats(std::ostream& out, EncodeProfile profile) {
+    uint64_t images = encode_stats.images.load();
+    if (images == 0)
+        return;
+    double raw = static_cast<double>(encode_stats.raw_bytes.load());
+    double png = static_cast<double>(encode_stats.png_bytes.load());
+    double seconds = encode_stats.nanoseconds.load() * 1e-9;
+    out << "encode (" << encode_profile_name(profile) << "): " << images << " images, "
+        << raw / 1e6 << " MB -> " << png / 1e6 << " MB (" << (raw > 0 ? 100.0 * png / raw : 0.0) << "%), "
+        << (seconds > 0 ? raw / 1e6 / seconds : 0.0) << " MB/s per thread" << std::endl;
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cmath>
+#include <cstdio>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "dispatch.h"
+#include "image.h"
+#include "journal.h"
+#include "metrics.h"
+#include "parallel.h"
+
+namespace fs = std::filesystem;
+
+// One output made from every decoded image. An empty tag replaces the input
+// file; otherwise the output is written to <dir>/<stem>.<tag>.png. transform
+// names everything rotate does, down to engine and interpolation: outputs
+// with equal transforms of equal inputs are taken to be identical (--dedup).
+struct RotationOutput {
+    std::string tag;
+    fs::path dir;  // empty = next to the input
+    std::function<Image(const Image&)> rotate;
+    std::string transform;
+};
+
+inline fs::path output_path_for(const fs::path& input, const RotationOutput& output) {
+    if (output.tag.empty())
+        return input;
+    fs::path dir = output.dir.empty() ? input.parent_path() : output.dir;
+    return dir / (input.stem().string() + "." + output.tag + input.extension().string());
+}
+
+// one entry of an --angles= job spec
+struct RotationJob {
+    std::string tag;
+    Transform transform;
+};
+
+// Parse a comma-separated job spec such as "90,110,-15,flip-h,flip-v,transpose".
+// Angles are tagged r<angle> (r110, r-15, r22.5), the others fliph, flipv and
+// transpose. Returns false on an unknown entry, a nan or infinite angle or a
+// repeated tag.
+inline bool parse_rotation_jobs(const std::string& spec, std::vector<RotationJob>& jobs) {
+    jobs.clear();
+    std::stringstream in(spec);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        RotationJob job;
+        if (item == "flip-h") {
+            job = {"fliph", oriented(Orientation::flip_horizontal)};
+        } else if (item == "flip-v") {
+            job = {"flipv", oriented(Orientation::flip_vertical)};
+        } else if (item == "transpose") {
+            job = {"transpose", oriented(Orientation::transpose)};
+        } else {
+            size_t used = 0;
+            double angle;
+            try {
+                angle = std::stod(item, &used);
+            } catch (const std::exception&) {
+                return false;
+            }
+            if (used != item.size() || !std::isfinite(angle))
+                return false;
+            job.transform = rotation_by(angle);
+            char tag[32];
+            std::snprintf(tag, sizeof(tag), "r%g", angle);
+            job.tag = tag;
+        }
+        for (const auto& other : jobs) {
+            if (other.tag == job.tag)
+                return false;
+        }
+        jobs.push_back(job);
+    }
+    return !jobs.empty() && spec.back() != ',';
+}
+
+// Rotate the decoded source once per output and write each result. Outputs go
+// onto idle pool threads, so a few files can keep every core busy; a failed
+// output is reported on its own and the others are still written.
+inline void write_outputs(const fs::path& input, const Image& source, const std::vector<RotationOutput>& outputs) {
+    parallel_tasks(static_cast<int>(outputs.size()), [&](int i) {
+        fs::path path = output_path_for(input, outputs[i]);
+        try {
+            Image rotated = timed(Stage::rotate, [&]() { return outputs[i].rotate(source); });
+            replace_png_file(path, rotated);
+        } catch (const std::exception& e) {
+            report_failure(path, e);
+        }
+    });
+}
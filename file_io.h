@@ -0,0 +1,202 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "buffer_pool.h"
+#include "metrics.h"
+
+// Files at least this large are mapped; smaller ones are read with a single
+// read(), which is cheaper than setting up and tearing down a mapping.
+constexpr size_t MMAP_MIN_BYTES = 256 * 1024;
+
+inline std::runtime_error file_error(const char* what, const char* filename, const char* reason) {
+    return std::runtime_error(std::string(what) + " " + filename + ": " + reason);
+}
+
+inline std::runtime_error file_error(const char* what, const char* filename) {
+    return file_error(what, filename, std::strerror(errno));
+}
+
+// contents of a whole input file, either mapped, read into a pooled buffer or
+// handed over as a vector
+class FileData {
+public:
+    FileData() = default;
+    ~FileData() { unmap(); }
+
+    FileData(FileData&& other) noexcept { *this = std::move(other); }
+    FileData& operator=(FileData&& other) noexcept {
+        if (this != &other) {
+            unmap();
+            buffer = std::move(other.buffer);
+            pooled = std::move(other.pooled);
+            mapping = std::exchange(other.mapping, nullptr);
+            length = std::exchange(other.length, 0);
+        }
+        return *this;
+    }
+    FileData(const FileData&) = delete;
+    FileData& operator=(const FileData&) = delete;
+
+    const unsigned char* data() const {
+        if (mapping)
+            return static_cast<const unsigned char*>(mapping);
+        return pooled ? pooled.get() : buffer.data();
+    }
+    size_t size() const { return length; }
+
+    // take over bytes that were loaded elsewhere
+    void assign(std::vector<unsigned char> bytes) {
+        unmap();
+        pooled.reset();
+        buffer = std::move(bytes);
+        length = buffer.size();
+    }
+
+    // load filename, replacing the current contents
+    void load(const char* filename) {
+        StageTimer timer(Stage::read);
+        unmap();
+        int fd = ::open(filename, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            throw file_error("Could not open file", filename);
+
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw file_error("Could not stat file", filename);
+        }
+        length = static_cast<size_t>(st.st_size);
+
+        if (length >= MMAP_MIN_BYTES) {
+            // populate up front, the decoder walks the whole file once
+            void* p = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+            if (p != MAP_FAILED) {
+                ::madvise(p, length, MADV_SEQUENTIAL);
+                mapping = p;
+                buffer.clear();
+                pooled.reset();
+                ::close(fd);
+                count(Counter::bytes_in, length);
+                return;
+            }
+        }
+
+        // the buffer of the previous file is kept if it is large enough
+        buffer.clear();
+        if (length > 0 && (!pooled || pooled.get_deleter().capacity < length)) {
+            pooled.reset();
+            pooled = acquire_bytes(length);
+        }
+        size_t done = 0;
+        while (done < length) {
+            ssize_t n = ::read(fd, pooled.get() + done, length - done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                // a file that shrank since fstat reads 0 bytes, and errno is not set
+                const char* reason = n == 0 ? "unexpected end of file" : std::strerror(errno);
+                ::close(fd);
+                length = 0;
+                throw file_error("Could not read file", filename, reason);
+            }
+            done += static_cast<size_t>(n);
+        }
+        ::close(fd);
+        count(Counter::bytes_in, length);
+    }
+
+private:
+    void unmap() {
+        if (mapping) {
+            ::munmap(mapping, length);
+            mapping = nullptr;
+            length = 0;
+        }
+    }
+
+    std::vector<unsigned char> buffer;  // from assign
+    PooledBytes pooled;                 // from load
+    void* mapping = nullptr;
+    size_t length = 0;
+};
+
+// replace the contents of a file with size bytes, normally in one write()
+inline void write_file(const char* filename, const unsigned char* data, size_t size) {
+    int fd = ::open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        throw file_error("Could not open file for writing", filename);
+
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = ::write(fd, data + done, size - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            const char* reason = n == 0 ? "short write" : std::strerror(errno);
+            ::close(fd);
+            throw file_error("Could not write file", filename, reason);
+        }
+        done += static_cast<size_t>(n);
+    }
+    if (::close(fd) != 0)
+        throw file_error("Could not write file", filename);
+    count(Counter::bytes_out, size);
+}
+
+inline void write_file(const char* filename, const std::vector<unsigned char>& bytes) {
+    write_file(filename, bytes.data(), bytes.size());
+}
+
+// Ask the kernel to start reading a file we are about to need, so that its
+// pages are in the cache by the time a worker gets to it. Only a hint: errors
+// are ignored.
+inline void prefetch_file(const char* filename) {
+    int fd = ::open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    ::close(fd);
+}
+
+// how many files ahead of the ones being worked on are hinted
+constexpr size_t PREFETCH_AHEAD = 16;
+
+// Issues prefetch_file for a batch in order, staying PREFETCH_AHEAD files ahead
+// of the highest index any worker has started. Safe to call from many threads.
+// Paths is any indexable list of paths that only grows, such as the vector of
+// a batch or the PathStream that discovery is still filling.
+template <typename Paths>
+class Prefetcher {
+public:
+    explicit Prefetcher(Paths& paths) : paths(paths) {}
+
+    void advance(size_t started) {
+        size_t target = std::min(paths.size(), started + 1 + PREFETCH_AHEAD);
+        size_t next = hinted.load(std::memory_order_relaxed);
+        while (next < target) {
+            if (hinted.compare_exchange_weak(next, next + 1, std::memory_order_relaxed)) {
+                const std::filesystem::path& path = paths[next];
+                prefetch_file(path.c_str());
+                ++next;
+            }
+        }
+    }
+
+private:
+    Paths& paths;
+    std::atomic<size_t> hinted{0};
+};
@@ -0,0 +1,212 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <type_traits>
+
+#include "buffer_pool.h"
+
+// rows start on this boundary so SIMD kernels can use aligned loads
+constexpr size_t IMAGE_ALIGNMENT = 64;
+static_assert(IMAGE_ALIGNMENT <= BUFFER_ALIGNMENT, "image rows must stay aligned");
+
+// bytes held by image buffers right now and at most so far (for --metrics)
+struct ImageMemory {
+    std::atomic<size_t> live{0};
+    std::atomic<size_t> peak{0};
+
+    void allocated(size_t bytes) {
+        size_t now = live.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+        size_t high = peak.load(std::memory_order_relaxed);
+        while (now > high && !peak.compare_exchange_weak(high, now, std::memory_order_relaxed)) {
+        }
+    }
+    void freed(size_t bytes) { live.fetch_sub(bytes, std::memory_order_relaxed); }
+};
+
+inline ImageMemory image_memory;
+
+// hands an image buffer back to the pool
+struct ImageBufferRelease {
+    size_t bytes = 0;  // in use by the image, counted in image_memory
+    size_t capacity = 0;
+    void operator()(unsigned char* p) const {
+        image_memory.freed(bytes);
+        buffer_pool.release({p, capacity});
+    }
+};
+
+// how the samples of a pixel are laid out, after the PNG colour types
+enum class PixelLayout {
+    rgba,
+    rgb,
+    gray_alpha,
+    gray,
+    palette,  // one byte, an index into PixelFormat::palette
+};
+
+// PLTE entries as RGBA, alpha taken from tRNS (255 where it has none).
+// Indices past size() read as opaque black.
+struct Palette {
+    std::array<std::array<unsigned char, 4>, 256> entries{};
+    int size = 0;
+};
+
+// Pixel format of an image: the layout and bit depth of its PNG, so an image
+// is rotated and written back in its own colour type. Depths below 8 still
+// keep one sample per byte in memory and are only packed in the PNG; 16-bit
+// samples are uint16_t in host byte order.
+struct PixelFormat {
+    PixelLayout layout = PixelLayout::rgba;
+    int bit_depth = 8;                       // 1, 2, 4, 8 or 16 (not for palettes)
+    std::shared_ptr<const Palette> palette;  // for PixelLayout::palette
+    unsigned char fill = 0;                  // byte of a pixel left uncovered (the transparent index)
+
+    int samples() const {
+        switch (layout) {
+        case PixelLayout::rgba:
+            return 4;
+        case PixelLayout::rgb:
+            return 3;
+        case PixelLayout::gray_alpha:
+            return 2;
+        default:
+            return 1;
+        }
+    }
+
+    int pixel_bytes() const { return bit_depth == 16 ? 2 * samples() : samples(); }
+
+    // whether a pixel filled with fill is transparent black, as the corners
+    // of an arbitrary-angle rotation have to be
+    bool has_transparent_fill() const {
+        if (layout == PixelLayout::palette)
+            return palette && fill < palette->size && palette->entries[fill] == std::array<unsigned char, 4>{0, 0, 0, 0};
+        return layout == PixelLayout::rgba || layout == PixelLayout::gray_alpha;
+    }
+};
+
+inline PixelFormat rgba_format(int bit_depth = 8) {
+    PixelFormat f;
+    f.bit_depth = bit_depth;
+    return f;
+}
+
+// the format interpolation works in (or its 16-bit version)
+constexpr int RGBA_PIXEL_BYTES = 4;
+
+// Image stored in one contiguous, aligned buffer from the buffer pool, 8-bit
+// RGBA unless a format is given. Pixel (x, y) lives at
+// data() + y * stride + x * pixel_bytes.
+struct Image {
+    int width = 0;
+    int height = 0;
+    size_t stride = 0;  // bytes between the starts of two rows
+    PixelFormat format;
+    int pixel_bytes = RGBA_PIXEL_BYTES;  // format.pixel_bytes()
+
+    Image() = default;
+    Image(int w, int h) { allocate(w, h); }
+    Image(int w, int h, PixelFormat f) { allocate(w, h, std::move(f)); }
+
+    Image(Image&&) = default;
+    Image& operator=(Image&&) = default;
+    Image(const Image&) = delete;
+    Image& operator=(const Image&) = delete;
+
+    // (re)allocate for w x h pixels in format f, contents are left uninitialized;
+    // the current buffer is kept if it is large enough
+    void allocate(int w, int h, PixelFormat f) {
+        format = std::move(f);
+        pixel_bytes = format.pixel_bytes();
+        allocate(w, h);
+    }
+
+    // the same, keeping the current format
+    void allocate(int w, int h) {
+        width = w;
+        height = h;
+        stride = (static_cast<size_t>(w) * pixel_bytes + IMAGE_ALIGNMENT - 1) / IMAGE_ALIGNMENT * IMAGE_ALIGNMENT;
+        // a stride that is a multiple of 4 KB maps every row of a column walk
+        // to the same cache sets, so pad it by one cache line
+        if (stride % 4096 == 0)
+            stride += IMAGE_ALIGNMENT;
+        size_t bytes = stride * static_cast<size_t>(h);
+        if (bytes == 0) {
+            buffer.reset();
+            return;
+        }
+        if (buffer && buffer.get_deleter().capacity >= bytes) {
+            ImageBufferRelease& in_use = buffer.get_deleter();
+            image_memory.freed(in_use.bytes);
+            image_memory.allocated(bytes);
+            in_use.bytes = bytes;
+            return;
+        }
+        buffer.reset();
+        PooledBuffer pooled = buffer_pool.acquire(bytes);
+        buffer = std::unique_ptr<unsigned char, ImageBufferRelease>(pooled.data,
+                                                                    ImageBufferRelease{bytes, pooled.capacity});
+        image_memory.allocated(bytes);
+    }
+
+    // fill every pixel with the format's fill (transparent black for RGBA)
+    void clear() {
+        if (buffer) {
+            std::memset(buffer.get(), format.fill, stride * static_cast<size_t>(height));
+        }
+    }
+
+    unsigned char* data() { return buffer.get(); }
+    const unsigned char* data() const { return buffer.get(); }
+
+    unsigned char* row(int y) { return buffer.get() + static_cast<size_t>(y) * stride; }
+    const unsigned char* row(int y) const { return buffer.get() + static_cast<size_t>(y) * stride; }
+
+    unsigned char* pixel(int x, int y) { return row(y) + static_cast<size_t>(x) * pixel_bytes; }
+    const unsigned char* pixel(int x, int y) const { return row(y) + static_cast<size_t>(x) * pixel_bytes; }
+
+private:
+    std::unique_ptr<unsigned char, ImageBufferRelease> buffer;
+};
+
+// copy one pixel of Bytes bytes
+template <int Bytes>
+inline void copy_pixel(unsigned char* dst, const unsigned char* src) {
+    std::memcpy(dst, src, Bytes);
+}
+
+// Call fn with the pixel size as a std::integral_constant, so kernels
+// templated on it are instantiated once per size.
+template <typename Fn>
+inline decltype(auto) with_pixel_bytes(int bytes, Fn&& fn) {
+    switch (bytes) {
+    case 1:
+        return fn(std::integral_constant<int, 1>());
+    case 2:
+        return fn(std::integral_constant<int, 2>());
+    case 3:
+        return fn(std::integral_constant<int, 3>());
+    case 6:
+        return fn(std::integral_constant<int, 6>());
+    case 8:
+        return fn(std::integral_constant<int, 8>());
+    default:
+        return fn(std::integral_constant<int, 4>());
+    }
+}
+
+// Call fn with a zero of the sample type of format, uint8_t or (for 16-bit)
+// uint16_t, for kernels that compute on samples rather than move pixels.
+template <typename Fn>
+inline decltype(auto) with_sample_type(const PixelFormat& format, Fn&& fn) {
+    if (format.bit_depth == 16)
+        return fn(uint16_t());
+    return fn(uint8_t());
+}
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "image.h"
+#include "metrics.h"
+#include "png_io.h"
+
+namespace fs = std::filesystem;
+
+// the rotated image is written here first and then renamed over the original
+inline fs::path temp_path_for(const fs::path& path) {
+    fs::path temp = path;
+    temp += ".tmp";
+    return temp;
+}
+
+inline void sync_path(const fs::path& path, int flags) {
+    int fd = ::open(path.c_str(), flags);
+    if (fd < 0 || ::fsync(fd) != 0) {
+        int err = errno;
+        if (fd >= 0)
+            ::close(fd);
+        throw std::runtime_error("Could not sync " + path.string() + ": " + std::strerror(err));
+    }
+    ::close(fd);
+}
+
+// Append-only record of a batch, one line per event:
+//   ready <path>   the rotated image is complete in <path>.tmp
+//   done <path>    <path> holds the rotated image
+//   failed <path>  the file was left untouched (the error follows on the line)
+// Each line goes out in a single write and is synced before the step it
+// guards, so after a crash every file is either untouched, or its rotated
+// image sits complete in the temp file ("ready"), or it is finished.
+class Journal {
+public:
+    explicit Journal(const fs::path& path) {
+        load(path);
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0)
+            throw std::runtime_error("Could not open journal " + path.string() + ": " + std::strerror(errno));
+    }
+
+    ~Journal() {
+        if (fd >= 0)
+            ::close(fd);
+    }
+
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    // Finish what a previous run left half done: a file recorded as ready was
+    // either renamed already, or its temp file is still waiting to be.
+    void recover() {
+        std::vector<fs::path> ready;
+        for (const auto& entry : last_state) {
+            if (entry.second == "ready")
+                ready.emplace_back(entry.first);
+        }
+        for (const auto& path : ready) {
+            fs::path temp = temp_path_for(path);
+            if (fs::exists(temp)) {
+                fs::rename(temp, path);
+                sync_path(path.parent_path().empty() ? fs::path(".") : path.parent_path(), O_RDONLY | O_DIRECTORY);
+            }
+            record("done", path);
+            last_state[path.string()] = "done";
+        }
+    }
+
+    bool is_done(const fs::path& path) const {
+        auto it = last_state.find(path.string());
+        return it != last_state.end() && it->second == "done";
+    }
+
+    size_t done_count() const {
+        size_t n = 0;
+        for (const auto& entry : last_state) {
+            n += entry.second == "done";
+        }
+        return n;
+    }
+
+    void record(const char* status, const fs::path& path, const std::string& detail = "") {
+        std::string line = format_record(status, path, detail);
+        if (::write(fd, line.data(), line.size()) != static_cast<ssize_t>(line.size()) || ::fdatasync(fd) != 0)
+            throw std::runtime_error(std::string("Could not write journal: ") + std::strerror(errno));
+    }
+
+    // one line as record writes it
+    static std::string format_record(const char* status, const fs::path& path, const std::string& detail = "") {
+        std::string line = std::string(status) + " " + path.string();
+        if (!detail.empty()) {
+            line += "\t" + detail;
+            std::replace(line.begin() + 1, line.end(), '\n', ' ');
+        }
+        line += "\n";
+        return line;
+    }
+
+    // The journal file, opened for appending. Writers that batch lines write
+    // format_record lines here themselves and sync them before relying on them
+    // (the io_uring file I/O of the pipeline).
+    int append_fd() const { return fd; }
+
+private:
+    void load(const fs::path& path) {
+        std::ifstream in(path);
+        std::string line;
+        while (std::getline(in, line)) {
+            size_t space = line.find(' ');
+            if (space == std::string::npos)
+                continue;  // not a record
+            size_t tab = line.find('\t', space);
+            std::string file = line.substr(space + 1, tab == std::string::npos ? std::string::npos : tab - space - 1);
+            last_state[file] = line.substr(0, space);
+        }
+    }
+
+    int fd = -1;
+    std::unordered_map<std::string, std::string> last_state;  // path -> last status
+};
+
+// journal of the running batch, if any
+inline Journal* active_journal = nullptr;
+
+// Replace path with the output that write produces. write fills a temp file
+// next to path, which is then renamed over path, so a crash or error never
+// leaves a half-written image behind. With a journal, the temp file is synced
+// and recorded as ready before the rename and recorded as done after it.
+inline void replace_file(const fs::path& path, const std::function<void(const fs::path&)>& write) {
+    StageTimer timer(Stage::write);
+    fs::path temp = temp_path_for(path);
+    try {
+        write(temp);
+    } catch (...) {
+        std::error_code ec;
+        fs::remove(temp, ec);
+        throw;
+    }
+
+    if (!active_journal) {
+        fs::rename(temp, path);
+        count(Counter::written);
+        return;
+    }
+    sync_path(temp, O_RDONLY);
+    active_journal->record("ready", path);
+    fs::rename(temp, path);
+    sync_path(path.parent_path().empty() ? fs::path(".") : path.parent_path(), O_RDONLY | O_DIRECTORY);
+    active_journal->record("done", path);
+    count(Counter::written);
+}
+
+// write_png_file with the same guarantees; the image is encoded before the
+// temp file is opened, so the write stage times only the file work
+inline void replace_png_file(const fs::path& path, const Image& image) {
+    thread_local std::vector<unsigned char> bytes;
+    encode_png(image, bytes);
+    replace_file(path, [&](const fs::path& temp) { write_file(temp.c_str(), bytes); });
+}
+
+// report a file that could not be processed; the others carry on
+inline void report_failure(const fs::path& path, const std::exception& e) {
+    std::cerr << "Error processing file " << path << ": " << e.what() << std::endl;
+    count(Counter::failed);
+    if (active_journal) {
+        try {
+            active_journal->record("failed", path, e.what());
+        } catch (const std::exception& journal_error) {
+            std::cerr << journal_error.what() << std::endl;
+        }
+    }
+}
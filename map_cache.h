@@ -0,0 +1,267 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "image.h"
+#include "parallel.h"
+#include "pixel_format.h"
+#include "rotate.h"
+
+// Precomputed inverse mapping of the reference rotation for one source size,
+// pixel size and angle. Per output row only [x0, x1) can land inside the source; every
+// pixel of that range stores the byte offset of its source pixel, or
+// MAP_OUTSIDE. Rotating an image of that size is then a pure gather.
+struct RotationMap {
+    RotationGeometry g;
+    size_t source_stride = 0;
+    int pixel_bytes = 0;
+    std::vector<int> x0;  // per output row
+    std::vector<int> x1;
+    std::vector<size_t> first;  // index of the row's first entry in offsets
+    std::vector<uint32_t> offsets;
+
+    size_t bytes() const {
+        return offsets.size() * sizeof(uint32_t) + x0.size() * (2 * sizeof(int) + sizeof(size_t));
+    }
+};
+
+constexpr uint32_t MAP_OUTSIDE = std::numeric_limits<uint32_t>::max();
+
+// maps are only built when every source offset fits in 32 bits
+inline bool mappable(const Image& image) {
+    return image.stride * static_cast<size_t>(image.height) < MAP_OUTSIDE;
+}
+
+// Same arithmetic as rotate_image_reference, so a gather through the
+// map gives bit-identical output.
+inline std::shared_ptr<const RotationMap> build_rotation_map(int width, int height, size_t source_stride,
+                                                             int pixel_bytes, double angle_degrees) {
+    auto map = std::make_shared<RotationMap>();
+    RotationGeometry& g = map->g;
+    g = rotation_geometry(width, height, angle_degrees);
+    map->source_stride = source_stride;
+    map->pixel_bytes = pixel_bytes;
+    map->x0.resize(g.new_height);
+    map->x1.resize(g.new_height);
+    map->first.resize(g.new_height);
+
+    std::vector<uint32_t> row;
+    for (int y = 0; y < g.new_height; ++y) {
+        row.assign(g.new_width, MAP_OUTSIDE);
+        int x0 = g.new_width;
+        int x1 = 0;
+        for (int x = 0; x < g.new_width; ++x) {
+            double xt = x - g.new_cx;
+            double yt = y - g.new_cy;
+
+            int orig_x = static_cast<int>(g.cos_theta * xt + g.sin_theta * yt + g.cx);
+            int orig_y = static_cast<int>(-g.sin_theta * xt + g.cos_theta * yt + g.cy);
+
+            if (orig_x >= 0 && orig_x < width && orig_y >= 0 && orig_y < height) {
+                row[x] = static_cast<uint32_t>(orig_y * source_stride + static_cast<size_t>(orig_x) * pixel_bytes);
+                x0 = std::min(x0, x);
+                x1 = x + 1;
+            }
+        }
+        if (x1 <= x0)
+            x0 = x1 = 0;
+        map->x0[y] = x0;
+        map->x1[y] = x1;
+        map->first[y] = map->offsets.size();
+        map->offsets.insert(map->offsets.end(), row.begin() + x0, row.begin() + x1);
+    }
+    map->offsets.shrink_to_fit();
+    return map;
+}
+
+// Rotate image_data through a map built for its size and pixel size. The
+// format must have a transparent fill (see with_transparency).
+inline Image rotate_image_mapped(const Image& image_data, const RotationMap& map) {
+    const RotationGeometry& g = map.g;
+    Image rotated_image(g.new_width, g.new_height, image_data.format);
+    const unsigned char* source = image_data.data();
+    unsigned char fill = image_data.format.fill;
+
+    with_pixel_bytes(map.pixel_bytes, [&](auto bytes) {
+        constexpr int Bytes = decltype(bytes)::value;
+        parallel_rows(g.new_height, g.new_width, 1, [&](int row_begin, int row_end) {
+            for (int y = row_begin; y < row_end; ++y) {
+                unsigned char* row = rotated_image.row(y);
+                int x0 = map.x0[y];
+                int x1 = map.x1[y];
+                const uint32_t* offsets = map.offsets.data() + map.first[y];
+
+                std::memset(row, fill, static_cast<size_t>(x0) * Bytes);
+                for (int x = x0; x < x1; ++x) {
+                    uint32_t offset = offsets[x - x0];
+                    unsigned char* dst = row + static_cast<size_t>(x) * Bytes;
+                    if (offset != MAP_OUTSIDE) {
+                        copy_pixel<Bytes>(dst, source + offset);
+                    } else {
+                        std::memset(dst, fill, Bytes);
+                    }
+                }
+                std::memset(row + static_cast<size_t>(x1) * Bytes, fill, static_cast<size_t>(g.new_width - x1) * Bytes);
+            }
+        });
+    });
+    return rotated_image;
+}
+
+// Thread-safe LRU cache of rotation maps, keyed by source size, pixel size and
+// angle.
+// Maps are handed out as shared pointers, so evicting one that a thread is
+// still gathering through is safe. A map larger than the whole capacity is
+// built and used but not kept.
+class RotationMapCache {
+public:
+    explicit RotationMapCache(size_t capacity_bytes) : capacity(capacity_bytes) {}
+
+    void set_capacity(size_t capacity_bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        capacity = capacity_bytes;
+        evict();
+    }
+
+    // the map for a width x height source of pixel_bytes pixels with rows stride bytes apart
+    std::shared_ptr<const RotationMap> get(int width, int height, size_t stride, int pixel_bytes,
+                                           double angle_degrees) {
+        Key key{width, height, stride, pixel_bytes, angle_bits(angle_degrees)};
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = index.find(key);
+            if (it != index.end()) {
+                entries.splice(entries.begin(), entries, it->second);
+                hit_count.fetch_add(1, std::memory_order_relaxed);
+                return it->second->map;
+            }
+        }
+        // built outside the lock; two threads missing on the same key both build
+        miss_count.fetch_add(1, std::memory_order_relaxed);
+        std::shared_ptr<const RotationMap> map = build_rotation_map(width, height, stride, pixel_bytes, angle_degrees);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (map->bytes() > capacity || index.count(key))
+            return map;
+        entries.push_front(Entry{key, map});
+        index[key] = entries.begin();
+        used += map->bytes();
+        evict();
+        return map;
+    }
+
+    uint64_t hits() const { return hit_count.load(); }
+    uint64_t misses() const { return miss_count.load(); }
+
+    size_t cached_bytes() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return used;
+    }
+
+    size_t cached_maps() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return entries.size();
+    }
+
+private:
+    struct Key {
+        int width;
+        int height;
+        size_t stride;
+        int pixel_bytes;
+        uint64_t angle;
+
+        bool operator==(const Key& other) const {
+            return width == other.width && height == other.height && stride == other.stride &&
+                   pixel_bytes == other.pixel_bytes && angle == other.angle;
+        }
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& k) const {
+            uint64_t h = static_cast<uint64_t>(static_cast<uint32_t>(k.width)) << 32 | static_cast<uint32_t>(k.height);
+            h ^= k.angle + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+            h ^= k.stride + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+            h ^= static_cast<uint64_t>(k.pixel_bytes) + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+            return static_cast<size_t>(h);
+        }
+    };
+
+    struct Entry {
+        Key key;
+        std::shared_ptr<const RotationMap> map;
+    };
+
+    static uint64_t angle_bits(double angle) {
+        uint64_t bits;
+        std::memcpy(&bits, &angle, sizeof(bits));
+        return bits;
+    }
+
+    // drop least recently used maps until the cache fits, with the lock held
+    void evict() {
+        while (used > capacity && !entries.empty()) {
+            used -= entries.back().map->bytes();
+            index.erase(entries.back().key);
+            entries.pop_back();
+        }
+    }
+
+    std::mutex mutex;
+    size_t capacity;
+    size_t used = 0;
+    std::list<Entry> entries;  // most recently used first
+    std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index;
+    std::atomic<uint64_t> hit_count{0};
+    std::atomic<uint64_t> miss_count{0};
+};
+
+constexpr size_t DEFAULT_MAP_CACHE_MB = 256;
+
+// maps of the reference engine; --map-cache=MB sets the capacity, 0 turns it off
+inline RotationMapCache rotation_map_cache(DEFAULT_MAP_CACHE_MB << 20);
+inline bool map_cache_enabled = true;
+
+// The reference engine: same-sized images share one precomputed mapping
+// unless the cache is off or the image is too large to map.
+inline Image rotate_image_cached(const Image& source_image, double angle_degrees) {
+    Image converted;
+    const Image& image_data = with_transparency(source_image, converted);
+    if (!map_cache_enabled || !mappable(image_data))
+        return rotate_image_reference(image_data, angle_degrees);
+    auto map = rotation_map_cache.get(image_data.width, image_data.height, image_data.stride, image_data.pixel_bytes,
+                                      angle_degrees);
+    return rotate_image_mapped(image_data, *map);
+}
+
+// --map-cache=MB
+inline bool parse_map_cache_size(const std::string& megabytes) {
+    int mb;
+    try {
+        mb = std::stoi(megabytes);
+    } catch (const std::exception&) {
+        return false;
+    }
+    if (mb < 0)
+        return false;
+    map_cache_enabled = mb > 0;
+    rotation_map_cache.set_capacity(static_cast<size_t>(mb) << 20);
+    return true;
+}
+
+inline void print_map_cache_stats(std::ostream& out) {
+    out << "map cache: " << rotation_map_cache.hits() << " hits, " << rotation_map_cache.misses() << " misses, "
+        << rotation_map_cache.cached_maps() << " maps (" << rotation_map_cache.cached_bytes() / 1e6 << " MB)"
+        << std::endl;
+}
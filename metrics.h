@@ -0,0 +1,274 @@
+#pragma once
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <vector>
+
+// steps of processing a file that are timed
+enum class Stage {
+    read,
+    decode,
+    rotate,
+    encode,
+    write,  // temp file, sync and rename
+};
+
+constexpr int STAGE_COUNT = 5;
+
+inline const char* stage_name(Stage stage) {
+    static const char* names[STAGE_COUNT] = {"read", "decode", "rotate", "encode", "write"};
+    return names[static_cast<int>(stage)];
+}
+
+// latency buckets: bucket 0 is below 1 us, bucket i covers [2^(i-1), 2^i) us
+constexpr int LATENCY_BUCKETS = 32;
+
+// Counters of one thread. Only the owning thread writes them, so updates are a
+// relaxed load and store rather than an atomic read-modify-write; a reporter
+// may read them at any time.
+struct ThreadMetrics {
+    struct StageCounters {
+        std::atomic<uint64_t> count{0};
+        std::atomic<uint64_t> total_ns{0};
+        std::atomic<uint64_t> max_ns{0};
+        std::array<std::atomic<uint64_t>, LATENCY_BUCKETS> buckets{};
+    };
+
+    std::array<StageCounters, STAGE_COUNT> stages;
+    std::atomic<uint64_t> bytes_in{0};
+    std::atomic<uint64_t> bytes_out{0};
+    std::atomic<uint64_t> pixels{0};
+    std::atomic<uint64_t> written{0};  // outputs in place
+    std::atomic<uint64_t> failed{0};
+};
+
+inline void bump(std::atomic<uint64_t>& counter, uint64_t n) {
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// Counters of every thread that recorded anything. Threads register once;
+// their counters outlive them so the report still sees finished threads.
+class MetricsRegistry {
+public:
+    ThreadMetrics& local() {
+        thread_local ThreadMetrics* mine = nullptr;
+        if (!mine) {
+            std::lock_guard<std::mutex> lock(mutex);
+            threads.push_back(std::make_unique<ThreadMetrics>());
+            mine = threads.back().get();
+        }
+        return *mine;
+    }
+
+    // call fn on the counters of every thread
+    template <typename Fn>
+    void for_each(Fn&& fn) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto& t : threads) {
+            fn(*t);
+        }
+    }
+
+private:
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadMetrics>> threads;
+};
+
+inline MetricsRegistry metrics;
+
+// set by --metrics or --progress; when off, nothing is timed
+inline bool metrics_enabled = false;
+
+inline uint64_t metrics_now_ns() {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+inline void record_stage(Stage stage, uint64_t ns) {
+    ThreadMetrics::StageCounters& s = metrics.local().stages[static_cast<int>(stage)];
+    bump(s.count, 1);
+    bump(s.total_ns, ns);
+    if (ns > s.max_ns.load(std::memory_order_relaxed))
+        s.max_ns.store(ns, std::memory_order_relaxed);
+    uint64_t us = ns / 1000;
+    int bucket = us == 0 ? 0 : std::min(LATENCY_BUCKETS - 1, 64 - __builtin_clzll(us));
+    bump(s.buckets[bucket], 1);
+}
+
+enum class Counter { bytes_in, bytes_out, pixels, written, failed };
+
+inline void count(Counter counter, uint64_t n = 1) {
+    if (!metrics_enabled)
+        return;
+    ThreadMetrics& m = metrics.local();
+    switch (counter) {
+    case Counter::bytes_in:
+        bump(m.bytes_in, n);
+        break;
+    case Counter::bytes_out:
+        bump(m.bytes_out, n);
+        break;
+    case Counter::pixels:
+        bump(m.pixels, n);
+        break;
+    case Counter::written:
+        bump(m.written, n);
+        break;
+    case Counter::failed:
+        bump(m.failed, n);
+        break;
+    }
+}
+
+// times the enclosing scope as one sample of stage
+class StageTimer {
+public:
+    explicit StageTimer(Stage stage) : stage(stage), start(metrics_enabled ? metrics_now_ns() : 0) {}
+    ~StageTimer() {
+        if (start)
+            record_stage(stage, metrics_now_ns() - start);
+    }
+
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+
+private:
+    Stage stage;
+    uint64_t start;
+};
+
+// run fn and time it as one sample of stage
+template <typename Fn>
+auto timed(Stage stage, Fn&& fn) {
+    StageTimer timer(stage);
+    return fn();
+}
+
+// all threads added up
+struct MetricsSnapshot {
+    struct StageTotals {
+        uint64_t count = 0;
+        uint64_t total_ns = 0;
+        uint64_t max_ns = 0;
+        std::array<uint64_t, LATENCY_BUCKETS> buckets{};
+
+        // upper bound in us of the bucket holding quantile q
+        uint64_t quantile_us(double q) const {
+            uint64_t target = static_cast<uint64_t>(q * count);
+            uint64_t seen = 0;
+            for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+                seen += buckets[i];
+                if (seen > target)
+                    return uint64_t(1) << i;
+            }
+            return uint64_t(1) << (LATENCY_BUCKETS - 1);
+        }
+    };
+
+    std::array<StageTotals, STAGE_COUNT> stages;
+    uint64_t bytes_in = 0;
+    uint64_t bytes_out = 0;
+    uint64_t pixels = 0;
+    uint64_t written = 0;
+    uint64_t failed = 0;
+    int threads = 0;
+};
+
+inline MetricsSnapshot metrics_snapshot() {
+    MetricsSnapshot snapshot;
+    metrics.for_each([&](const ThreadMetrics& m) {
+        ++snapshot.threads;
+        for (int s = 0; s < STAGE_COUNT; ++s) {
+            const ThreadMetrics::StageCounters& from = m.stages[s];
+            MetricsSnapshot::StageTotals& to = snapshot.stages[s];
+            to.count += from.count.load(std::memory_order_relaxed);
+            to.total_ns += from.total_ns.load(std::memory_order_relaxed);
+            to.max_ns = std::max(to.max_ns, from.max_ns.load(std::memory_order_relaxed));
+            for (int b = 0; b < LATENCY_BUCKETS; ++b) {
+                to.buckets[b] += from.buckets[b].load(std::memory_order_relaxed);
+            }
+        }
+        snapshot.bytes_in += m.bytes_in.load(std::memory_order_relaxed);
+        snapshot.bytes_out += m.bytes_out.load(std::memory_order_relaxed);
+        snapshot.pixels += m.pixels.load(std::memory_order_relaxed);
+        snapshot.written += m.written.load(std::memory_order_relaxed);
+        snapshot.failed += m.failed.load(std::memory_order_relaxed);
+    });
+    return snapshot;
+}
+
+// peak resident set of the process, in bytes
+inline uint64_t peak_rss_bytes() {
+    struct rusage usage;
+    if (::getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+}
+
+// one line for --progress, formatted apart so out keeps its own settings
+inline void print_progress(std::ostream& out, const MetricsSnapshot& s, uint64_t total, double seconds) {
+    std::ostringstream line;
+    line << "progress: " << s.written << "/" << total << " outputs";
+    if (s.failed)
+        line << ", " << s.failed << " failed";
+    line << std::fixed << std::setprecision(1) << ", " << (seconds > 0 ? s.written / seconds : 0.0) << " files/s, "
+         << (seconds > 0 ? s.pixels / 1e6 / seconds : 0.0) << " MPix/s, " << s.bytes_in / 1e6 << " MB in, "
+         << s.bytes_out / 1e6 << " MB out, " << seconds << " s";
+    out << line.str() << std::endl;
+}
+
+// The batch report written by --metrics: totals, then per stage the number of
+// samples, time spent, mean/max and estimated percentiles (bucket upper
+// bounds), and the latency histogram as [upper bound in us, samples] pairs.
+inline void write_metrics_json(std::ostream& out, const MetricsSnapshot& s, uint64_t inputs, double seconds,
+                               uint64_t peak_image_bytes) {
+    std::ostringstream json;
+    json << "{\n";
+    json << "  \"inputs\": " << inputs << ",\n";
+    json << "  \"outputs_written\": " << s.written << ",\n";
+    json << "  \"failed\": " << s.failed << ",\n";
+    json << std::fixed << std::setprecision(3);
+    json << "  \"wall_seconds\": " << seconds << ",\n";
+    json << "  \"threads\": " << s.threads << ",\n";
+    json << "  \"bytes_in\": " << s.bytes_in << ",\n";
+    json << "  \"bytes_out\": " << s.bytes_out << ",\n";
+    json << "  \"pixels\": " << s.pixels << ",\n";
+    json << "  \"files_per_second\": " << (seconds > 0 ? s.written / seconds : 0.0) << ",\n";
+    json << "  \"mpix_per_second\": " << (seconds > 0 ? s.pixels / 1e6 / seconds : 0.0) << ",\n";
+    json << "  \"peak_image_bytes\": " << peak_image_bytes << ",\n";
+    json << "  \"peak_rss_bytes\": " << peak_rss_bytes() << ",\n";
+    json << "  \"stages\": {\n";
+    for (int i = 0; i < STAGE_COUNT; ++i) {
+        const MetricsSnapshot::StageTotals& st = s.stages[i];
+        json << "    \"" << stage_name(static_cast<Stage>(i)) << "\": {";
+        json << "\"count\": " << st.count;
+        json << ", \"total_ms\": " << st.total_ns / 1e6;
+        json << ", \"mean_us\": " << (st.count ? st.total_ns / 1e3 / st.count : 0.0);
+        json << ", \"max_us\": " << st.max_ns / 1e3;
+        json << ", \"p50_us\": " << (st.count ? st.quantile_us(0.5) : 0);
+        json << ", \"p90_us\": " << (st.count ? st.quantile_us(0.9) : 0);
+        json << ", \"p99_us\": " << (st.count ? st.quantile_us(0.99) : 0);
+        json << ", \"histogram_us\": [";
+        bool first = true;
+        for (int b = 0; b < LATENCY_BUCKETS; ++b) {
+            if (!st.buckets[b])
+                continue;
+            json << (first ? "" : ", ") << "[" << (uint64_t(1) << b) << ", " << st.buckets[b] << "]";
+            first = false;
+        }
+        json << "]}" << (i + 1 < STAGE_COUNT ? "," : "") << "\n";
+    }
+    json << "  }\n";
+    json << "}\n";
+    out << json.str();
+}
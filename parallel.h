@@ -0,0 +1,130 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+
+#include "thread_pool.h"
+
+// images with fewer output pixels than this are always rotated by one thread
+constexpr size_t PARALLEL_MIN_PIXELS = size_t(1) << 20;
+
+// smallest band worth handing to another thread
+constexpr size_t PARALLEL_BAND_PIXELS = size_t(1) << 16;
+
+// How many bands to cut rows x row_pixels into. Splitting only pays off when
+// the image is large and the pool has threads with nothing else to do: while
+// at least one file per thread is still queued, whole files already keep every
+// core busy and one band per image is best.
+inline int parallel_band_count(const ThreadPool* pool, int rows, size_t row_pixels) {
+    if (!pool || pool->size() < 2 || rows < 2)
+        return 1;
+    size_t pixels = static_cast<size_t>(rows) * row_pixels;
+    if (pixels < PARALLEL_MIN_PIXELS)
+        return 1;
+    size_t queued = pool->queued();
+    size_t threads = static_cast<size_t>(pool->size());
+    if (queued >= threads)
+        return 1;
+    size_t bands = std::min(threads - queued, pixels / PARALLEL_BAND_PIXELS);
+    return static_cast<int>(std::clamp<size_t>(bands, 1, static_cast<size_t>(rows)));
+}
+
+// Run part(i) for every i in [0, count) on pool, with own() run by the caller
+// in the meantime. Parts are claimed from a counter: each queued task runs the
+// next unclaimed part, and once own() is done the caller claims the rest
+// itself. A waiting caller therefore only ever helps with its own parts, never
+// with whole files queued behind them, so waits do not nest. The caller then
+// sleeps until the parts other threads started are done. Tasks that come up
+// after every part was claimed do nothing; they hold the counters, which
+// outlive this call.
+template <typename PartFn, typename OwnFn>
+inline void run_split(ThreadPool& pool, int count, PartFn& part, OwnFn&& own) {
+    struct Split {
+        std::atomic<int> next{0};
+        std::atomic<int> remaining;
+        std::mutex mutex;
+        std::condition_variable finished;
+    };
+    auto split = std::make_shared<Split>();
+    split->remaining.store(count, std::memory_order_relaxed);
+    auto run_next = [](Split& split, int count, PartFn* part) {
+        int i = split.next.fetch_add(1, std::memory_order_relaxed);
+        if (i >= count)
+            return false;
+        (*part)(i);
+        if (split.remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            std::lock_guard<std::mutex> lock(split.mutex);
+            split.finished.notify_one();
+        }
+        return true;
+    };
+    for (int i = 0; i < count; ++i) {
+        pool.submit([split, count, part = &part, run_next]() { run_next(*split, count, part); });
+    }
+    own();
+
+    while (run_next(*split, count, &part)) {
+    }
+    std::unique_lock<std::mutex> lock(split->mutex);
+    split->finished.wait(lock, [&]() { return split->remaining.load(std::memory_order_acquire) == 0; });
+}
+
+// Run rows(begin, end) over [0, rows) of an image rows x row_pixels in size.
+// Called from a pool worker, the rows may be split into bands that run on the
+// same pool; band boundaries are multiples of align. The calling thread does
+// the first band itself and then takes over the other bands no thread has
+// started yet (run_split). Anywhere else everything runs on the calling thread.
+template <typename RowFn>
+inline void parallel_rows(int rows, size_t row_pixels, int align, RowFn&& fn) {
+    ThreadPool* pool = ThreadPool::current();
+    int bands = parallel_band_count(pool, rows, row_pixels);
+    int band_rows = (rows + bands - 1) / bands;
+    band_rows = (band_rows + align - 1) / align * align;
+    if (bands < 2 || band_rows >= rows) {
+        fn(0, rows);
+        return;
+    }
+
+    // band b + 1, the first is the caller's
+    int others = (rows - 1) / band_rows;
+    auto band = [&](int b) {
+        int begin = (b + 1) * band_rows;
+        fn(begin, std::min(begin + band_rows, rows));
+    };
+    run_split(*pool, others, band, [&]() { fn(0, band_rows); });
+}
+
+// Run task(i) for every i in [0, count). Called from a pool worker while
+// threads are idle, tasks after the first go onto the same pool, as many as
+// there are idle threads; the rest run on the calling thread, which then
+// takes over the queued ones no thread has started (run_split). Tasks must
+// not throw.
+template <typename TaskFn>
+inline void parallel_tasks(int count, TaskFn&& task) {
+    ThreadPool* pool = ThreadPool::current();
+    int spread = 0;
+    if (pool && count > 1) {
+        size_t queued = pool->queued();
+        size_t threads = static_cast<size_t>(pool->size());
+        if (queued + 1 < threads)
+            spread = static_cast<int>(std::min<size_t>(threads - queued - 1, static_cast<size_t>(count - 1)));
+    }
+    if (spread == 0) {
+        for (int i = 0; i < count; ++i) {
+            task(i);
+        }
+        return;
+    }
+
+    auto spread_task = [&](int i) { task(i + 1); };
+    run_split(*pool, spread, spread_task, [&]() {
+        task(0);
+        for (int i = spread + 1; i < count; ++i) {
+            task(i);
+        }
+    });
+}
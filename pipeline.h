@@ -0,0 +1,931 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "dedup_cache.h"
+#include "discovery.h"
+#include "fanout.h"
+#include "file_io.h"
+#include "image.h"
+#include "journal.h"
+#include "metrics.h"
+#include "png_io.h"
+#include "uring.h"
+
+namespace fs = std::filesystem;
+
+// Bounded multi-producer/multi-consumer ring (Vyukov). Every cell carries a
+// sequence number that tells producers and consumers whose turn it is, so a
+// push or pop is one CAS on the position plus one store, with no lock.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) {
+        size_t n = 2;
+        while (n < capacity)
+            n <<= 1;
+        mask = n - 1;
+        cells.reset(new Cell[n]);
+        for (size_t i = 0; i < n; ++i) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    size_t capacity() const { return mask + 1; }
+
+    // approximate number of queued items
+    size_t size() const {
+        size_t tail = dequeue_pos.load(std::memory_order_relaxed);
+        size_t head = enqueue_pos.load(std::memory_order_relaxed);
+        return head > tail ? head - tail : 0;
+    }
+
+    // moves value in and returns true, or returns false if the queue is full
+    bool try_push(T& value) {
+        Cell* cell;
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &cells[pos & mask];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = std::move(value);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // moves the oldest item out and returns true, or returns false if empty
+    bool try_pop(T& value) {
+        Cell* cell;
+        size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            cell = &cells[pos & mask];
+            size_t seq = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        value = std::move(cell->value);
+        cell->sequence.store(pos + mask + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask = 0;
+    alignas(64) std::atomic<size_t> enqueue_pos{0};
+    alignas(64) std::atomic<size_t> dequeue_pos{0};
+};
+
+// back off while a queue is full or empty: spin briefly, then yield, then sleep
+inline void pipeline_backoff(int& attempt) {
+    if (attempt < 64) {
+        ++attempt;
+    } else if (attempt < 128) {
+        ++attempt;
+        std::this_thread::yield();
+    } else {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+}
+
+// A queue between two stages. It closes once every producer has finished, and
+// keeps the counters that show which side of it is the bottleneck.
+template <typename T>
+class StageQueue {
+public:
+    StageQueue(std::string name, size_t capacity, int producers)
+        : name(std::move(name)), queue(capacity), open_producers(producers) {}
+
+    // blocks while the queue is full
+    void push(T value) {
+        int attempt = 0;
+        bool waited = false;
+        while (!queue.try_push(value)) {
+            waited = true;
+            pipeline_backoff(attempt);
+        }
+        if (waited)
+            full_waits.fetch_add(1, std::memory_order_relaxed);
+        note_depth();
+    }
+
+    // non-blocking push for a producer that must not stall; value is moved
+    // in only on success
+    bool try_push(T& value) {
+        if (!queue.try_push(value))
+            return false;
+        note_depth();
+        return true;
+    }
+
+    // non-blocking pop
+    bool try_pop(T& value) { return queue.try_pop(value); }
+
+    // every producer is done and everything has been taken
+    bool drained() const { return open_producers.load(std::memory_order_acquire) == 0 && queue.size() == 0; }
+
+    // blocks while the queue is empty; false once it is empty and closed
+    bool pop(T& value) {
+        int attempt = 0;
+        bool waited = false;
+        while (!queue.try_pop(value)) {
+            if (open_producers.load(std::memory_order_acquire) == 0) {
+                // a producer may have pushed just before closing
+                return queue.try_pop(value);
+            }
+            waited = true;
+            pipeline_backoff(attempt);
+        }
+        if (waited)
+            empty_waits.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // called by every producer when it is done
+    void producer_done() { open_producers.fetch_sub(1, std::memory_order_acq_rel); }
+
+    size_t depth() const { return queue.size(); }
+    size_t capacity() const { return queue.capacity(); }
+
+    const std::string name;
+    std::atomic<size_t> peak_depth{0};
+    std::atomic<size_t> full_waits{0};   // pushes that found the queue full
+    std::atomic<size_t> empty_waits{0};  // pops that found the queue empty
+
+private:
+    void note_depth() {
+        size_t depth = queue.size();
+        size_t peak = peak_depth.load(std::memory_order_relaxed);
+        while (depth > peak && !peak_depth.compare_exchange_weak(peak, depth, std::memory_order_relaxed)) {
+        }
+    }
+
+    BoundedQueue<T> queue;
+    std::atomic<int> open_producers;
+};
+
+// worker counts per stage and queue sizes
+struct PipelineOptions {
+    bool enabled = false;
+    int read_threads = 0;    // 0 = chosen from the core count
+    int decode_threads = 0;
+    int rotate_threads = 0;
+    int encode_threads = 0;  // encode and write back
+    int queue_depth = 8;
+    bool stats = false;      // print queue depths while running and a summary
+    bool io_uring = false;   // file I/O through io_uring instead of read/encode threads
+};
+
+// fill in the stage sizes that were left at 0
+inline void resolve_pipeline_threads(PipelineOptions& options, int cores) {
+    // deflate is usually the most expensive step, then inflate, then the rotation
+    auto pick = [cores](int& threads, int share) {
+        if (threads <= 0)
+            threads = std::max(1, cores * share / 8);
+    };
+    pick(options.read_threads, 1);
+    pick(options.decode_threads, 2);
+    pick(options.rotate_threads, 2);
+    pick(options.encode_threads, 3);
+}
+
+struct LoadedFile {
+    fs::path path;
+    FileData contents;
+};
+
+struct DecodedImage {
+    fs::path path;
+    Image image;
+    DedupKey key;  // with --dedup: the input's hash, and the output's transform once rotated
+};
+
+struct EncodedFile {
+    fs::path path;
+    std::vector<unsigned char> bytes;
+};
+
+// files the io_uring thread keeps in flight, for reads and for writes each
+constexpr unsigned URING_FILES_IN_FLIGHT = 32;
+
+// The file I/O of a whole pipeline on one thread and one io_uring: opens,
+// reads, writes, syncs, closes and renames for up to URING_FILES_IN_FLIGHT
+// files each way are in flight at once and advanced as they complete. Loaded
+// files go to `loaded`; encoded outputs taken from `written` are replaced
+// with the same temp-file, journal and rename steps as replace_file. This
+// thread never blocks on a queue, so a full pipeline cannot stall its writes.
+//
+// With --journal nothing blocks on the disk either. The folder of a renamed
+// output is synced on the ring (open, fsync, close), and journal lines are
+// not written one by one: the lines of all writes waiting for one are
+// appended in a single write and synced with a single fdatasync on the ring.
+// A write continues once its line is durable, so a "ready" line is still on
+// disk before its rename. Should the ring itself fail, the files in flight
+// are reported as failed and the batch is finished with blocking I/O.
+class UringFileIo {
+public:
+    UringFileIo(IoUring& ring, PathStream& image_paths,
+                StageQueue<LoadedFile>& loaded, StageQueue<EncodedFile>& written)
+        : ring(ring), image_paths(image_paths), loaded(loaded), written(written) {}
+
+    void run() {
+        while (true) {
+            try {
+                if (poll())
+                    break;
+            } catch (const std::exception& e) {
+                abandon_ring(e);
+            }
+        }
+        // the ring may have created these after abandon_ring removed them
+        for (const fs::path& temp : abandoned_temps)
+            ::unlink(temp.c_str());
+    }
+
+private:
+    enum class Step { open, read, write, sync, close, rename, open_dir, sync_dir, close_dir, journal_write, journal_sync };
+
+    struct Task {
+        bool writing = false;
+        Step step = Step::open;
+        fs::path path;  // the file read, or the file replaced
+        fs::path temp;  // writes go here first
+        fs::path dir;   // folder of path, synced after the rename
+        int fd = -1;
+        std::vector<unsigned char> bytes;
+        size_t done = 0;
+        uint64_t started = 0;  // metrics_now_ns() at open, 0 = not timed
+        std::vector<std::unique_ptr<Task>> waiting;  // a journal batch: the writes whose lines it holds
+    };
+
+    // one round: start what can be started, submit, take the completions;
+    // true once everything is done
+    bool poll() {
+        bool progress = false;
+        fs::path path;
+        while (reads_active + ready.size() < URING_FILES_IN_FLIGHT && image_paths.try_get(next_path, path)) {
+            start_read(path);
+            ++next_path;
+            progress = true;
+        }
+        while (!ready.empty() && loaded.try_push(ready.front())) {
+            ready.pop_front();
+            progress = true;
+        }
+        if (!loaded_closed && reads_active == 0 && ready.empty() && image_paths.ended_before(next_path)) {
+            loaded.producer_done();
+            loaded_closed = true;
+        }
+        EncodedFile file;
+        while (writes_active < URING_FILES_IN_FLIGHT && written.try_pop(file)) {
+            start_write(std::move(file));
+            progress = true;
+        }
+
+        if (loaded_closed && writes_active == 0 && written.drained())
+            return true;
+        if (broken) {
+            if (!progress)
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            return false;
+        }
+        flush_journal();
+
+        // sleep in the kernel only while operations are pending and
+        // nothing here can move on without them
+        bool pending = reads_active + writes_active > 0;
+        ring.submit(pending && !progress ? 1 : 0);
+        io_uring_cqe cqe;
+        bool completed = false;
+        while (ring.next_completion(cqe)) {
+            Task* task = reinterpret_cast<Task*>(cqe.user_data);
+            in_flight.erase(task);
+            complete(std::unique_ptr<Task>(task), cqe.res);
+            completed = true;
+        }
+        if (!pending && !progress && !completed) {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        return false;
+    }
+
+    io_uring_sqe* next_sqe() {
+        io_uring_sqe* sqe = ring.get_sqe();
+        if (!sqe) {
+            // more entries than files in flight, so this only happens if completions lag
+            ring.submit(0);
+            sqe = ring.get_sqe();
+            if (!sqe)
+                throw std::runtime_error("io_uring submission ring is full");
+        }
+        return sqe;
+    }
+
+    // queue the next operation of task; the ring owns it from here until it
+    // completes. If this throws, task is still the caller's.
+    void issue(std::unique_ptr<Task>& task, Step step) {
+        io_uring_sqe* sqe = next_sqe();
+        task->step = step;
+        switch (step) {
+        case Step::open:
+        case Step::open_dir:
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            if (step == Step::open_dir) {
+                sqe->addr = reinterpret_cast<uintptr_t>(task->dir.c_str());
+                sqe->open_flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+                break;
+            }
+            sqe->addr = reinterpret_cast<uintptr_t>(task->writing ? task->temp.c_str() : task->path.c_str());
+            sqe->open_flags = task->writing ? O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC : O_RDONLY | O_CLOEXEC;
+            sqe->len = 0644;
+            break;
+        case Step::read:
+        case Step::write:
+        case Step::journal_write:
+            sqe->opcode = step == Step::read ? IORING_OP_READ : IORING_OP_WRITE;
+            sqe->fd = task->fd;
+            sqe->addr = reinterpret_cast<uintptr_t>(task->bytes.data() + task->done);
+            sqe->len = static_cast<unsigned>(std::min<size_t>(task->bytes.size() - task->done, 1u << 30));
+            // the journal is opened O_APPEND, its lines go to the end whatever the offset
+            sqe->off = step == Step::journal_write ? 0 : task->done;
+            break;
+        case Step::sync:
+        case Step::sync_dir:
+        case Step::journal_sync:
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->fd = task->fd;
+            sqe->fsync_flags = step == Step::sync_dir ? 0 : IORING_FSYNC_DATASYNC;
+            break;
+        case Step::close:
+        case Step::close_dir:
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->fd = task->fd;
+            break;
+        case Step::rename:
+            sqe->opcode = IORING_OP_RENAMEAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = reinterpret_cast<uintptr_t>(task->temp.c_str());
+            sqe->len = static_cast<unsigned>(AT_FDCWD);
+            sqe->addr2 = reinterpret_cast<uintptr_t>(task->path.c_str());
+            break;
+        }
+        Task* issued = task.release();
+        in_flight.insert(issued);
+        sqe->user_data = reinterpret_cast<uintptr_t>(issued);
+    }
+
+    void start_read(const fs::path& path) {
+        if (broken) {
+            read_blocking(path);
+            return;
+        }
+        auto task = std::make_unique<Task>();
+        task->path = path;
+        task->started = metrics_enabled ? metrics_now_ns() : 0;
+        ++reads_active;
+        try {
+            issue(task, Step::open);
+        } catch (...) {
+            --reads_active;  // the path is taken again after the fallback
+            throw;
+        }
+    }
+
+    void start_write(EncodedFile file) {
+        if (broken) {
+            write_blocking(file);
+            return;
+        }
+        auto task = std::make_unique<Task>();
+        task->writing = true;
+        task->temp = temp_path_for(file.path);
+        task->path = std::move(file.path);
+        task->bytes = std::move(file.bytes);
+        task->started = metrics_enabled ? metrics_now_ns() : 0;
+        ++writes_active;
+        try {
+            issue(task, Step::open);
+        } catch (...) {
+            --writes_active;
+            write_blocking(EncodedFile{std::move(task->path), std::move(task->bytes)});
+            throw;
+        }
+    }
+
+    void read_blocking(const fs::path& path) {
+        LoadedFile file;
+        file.path = path;
+        try {
+            file.contents.load(file.path.c_str());
+        } catch (const std::exception& e) {
+            report_failure(file.path, e);
+            return;
+        }
+        ready.push_back(std::move(file));
+    }
+
+    void write_blocking(const EncodedFile& file) {
+        try {
+            replace_file(file.path, [&](const fs::path& temp) { write_file(temp.c_str(), file.bytes); });
+        } catch (const std::exception& e) {
+            report_failure(file.path, e);
+        }
+    }
+
+    void finish(Task& task) {
+        --(task.writing ? writes_active : reads_active);
+    }
+
+    void fail(Task& task, const std::string& what, int err) {
+        if (task.fd >= 0 && task.step != Step::close && task.step != Step::close_dir)
+            ::close(task.fd);
+        if (task.writing)
+            ::unlink(task.temp.c_str());
+        report_failure(task.path, std::runtime_error(what + " " + task.path.string() + ": " + std::strerror(err)));
+        finish(task);
+    }
+
+    // a written output is in place (and journaled)
+    void written_out(Task& task) {
+        if (task.started)
+            record_stage(Stage::write, metrics_now_ns() - task.started);
+        count(Counter::bytes_out, task.bytes.size());
+        count(Counter::written);
+        finish(task);
+    }
+
+    // hold task until its journal line is durable; it then goes on from the
+    // step it completed last (close: rename it, close_dir: it is done)
+    void wait_for_journal(std::unique_ptr<Task> task, const char* status) {
+        journal_lines += Journal::format_record(status, task->path);
+        journal_waiting.push_back(std::move(task));
+    }
+
+    // append the waiting lines in one write, unless a batch is still on its way
+    void flush_journal() {
+        if (journal_busy || journal_waiting.empty())
+            return;
+        auto batch = std::make_unique<Task>();
+        batch->fd = active_journal->append_fd();
+        batch->bytes.assign(journal_lines.begin(), journal_lines.end());
+        batch->waiting = std::move(journal_waiting);
+        journal_waiting.clear();
+        journal_lines.clear();
+        try {
+            issue(batch, Step::journal_write);
+        } catch (...) {
+            journal_waiting = std::move(batch->waiting);
+            throw;
+        }
+        journal_busy = true;
+    }
+
+    // a batch of journal lines was appended, or synced; should the ring fail
+    // on the way, its writes wait again for abandon_ring
+    void complete_journal(std::unique_ptr<Task> batch, int res) {
+        if (batch->step == Step::journal_write && res >= 0 && static_cast<size_t>(res) == batch->bytes.size()) {
+            try {
+                issue(batch, Step::journal_sync);
+            } catch (...) {
+                journal_waiting = std::move(batch->waiting);
+                throw;
+            }
+            return;
+        }
+        journal_busy = false;
+        std::exception_ptr ring_error;
+        for (auto& task : batch->waiting) {
+            if (res < 0 || batch->step == Step::journal_write) {
+                int err = res < 0 ? -res : EIO;  // a short append
+                fail(*task, "Could not write journal for", err);
+            } else if (task->step != Step::close) {
+                written_out(*task);
+            } else if (ring_error) {
+                journal_waiting.push_back(std::move(task));
+            } else {
+                try {
+                    issue(task, Step::rename);
+                } catch (...) {
+                    ring_error = std::current_exception();
+                    journal_waiting.push_back(std::move(task));
+                }
+            }
+        }
+        if (ring_error)
+            std::rethrow_exception(ring_error);
+    }
+
+    void complete(std::unique_ptr<Task> task, int res) {
+        if (task->step == Step::journal_write || task->step == Step::journal_sync) {
+            complete_journal(std::move(task), res);
+            return;
+        }
+        Task& t = *task;
+        try {
+            // a failed close of a file read, or of a synced folder, loses nothing
+            if (res < 0 && !(t.step == Step::close && !t.writing) && t.step != Step::close_dir) {
+                bool dir = t.step == Step::open_dir || t.step == Step::sync_dir;
+                fail(t, dir ? "Could not sync the folder of" : t.writing ? "Could not write file" : "Could not read file",
+                     -res);
+                return;
+            }
+            switch (t.step) {
+            case Step::open:
+                t.fd = res;
+                if (t.writing) {
+                    issue(task, t.bytes.empty() ? Step::close : Step::write);
+                } else {
+                    struct stat st;
+                    if (::fstat(t.fd, &st) != 0) {
+                        fail(t, "Could not stat file", errno);
+                        return;
+                    }
+                    t.bytes.resize(static_cast<size_t>(st.st_size));
+                    issue(task, t.bytes.empty() ? Step::close : Step::read);
+                }
+                break;
+            case Step::read:
+                if (res == 0)
+                    t.bytes.resize(t.done);  // the file shrank
+                t.done += static_cast<size_t>(res);
+                issue(task, t.done < t.bytes.size() ? Step::read : Step::close);
+                break;
+            case Step::write:
+                t.done += static_cast<size_t>(res);
+                if (t.done < t.bytes.size()) {
+                    issue(task, Step::write);
+                } else {
+                    issue(task, active_journal ? Step::sync : Step::close);
+                }
+                break;
+            case Step::sync:
+                issue(task, Step::close);
+                break;
+            case Step::close:
+                t.fd = -1;
+                if (!t.writing) {
+                    if (t.started)
+                        record_stage(Stage::read, metrics_now_ns() - t.started);
+                    count(Counter::bytes_in, t.bytes.size());
+                    LoadedFile file;
+                    file.path = std::move(t.path);
+                    file.contents.assign(std::move(t.bytes));
+                    ready.push_back(std::move(file));
+                    finish(t);
+                    break;
+                }
+                if (active_journal) {
+                    wait_for_journal(std::move(task), "ready");
+                } else {
+                    issue(task, Step::rename);
+                }
+                break;
+            case Step::rename:
+                if (!active_journal) {
+                    written_out(t);
+                    break;
+                }
+                t.dir = t.path.parent_path().empty() ? fs::path(".") : t.path.parent_path();
+                issue(task, Step::open_dir);
+                break;
+            case Step::open_dir:
+                t.fd = res;
+                issue(task, Step::sync_dir);
+                break;
+            case Step::sync_dir:
+                issue(task, Step::close_dir);
+                break;
+            case Step::close_dir:
+                t.fd = -1;
+                wait_for_journal(std::move(task), "done");
+                break;
+            default:
+                break;
+            }
+        } catch (const std::exception& e) {
+            // issue could not queue the next step, task is still ours
+            if (t.fd >= 0 && t.step != Step::close && t.step != Step::close_dir)
+                ::close(t.fd);
+            if (t.writing)
+                ::unlink(t.temp.c_str());
+            report_failure(t.path, e);
+            finish(t);
+        }
+    }
+
+    // The ring failed (io_uring_enter or a full submission ring). Operations
+    // it still holds may yet run, so their tasks are left to it: reads start
+    // over with blocking calls, outputs already renamed are finished with
+    // them, and other writes are reported as failed since the ring may still
+    // touch their temp files. Writes held back for the journal are finished
+    // with blocking calls, and so is everything after this.
+    void abandon_ring(const std::exception& e) {
+        std::cerr << "io_uring failed (" << e.what() << "), finishing with blocking I/O" << std::endl;
+        broken = true;
+        std::vector<std::unique_ptr<Task>> waiting = std::move(journal_waiting);
+        journal_waiting.clear();
+        for (Task* task : in_flight) {
+            if (task->step == Step::journal_write || task->step == Step::journal_sync) {
+                // the lines may or may not have made it; they are written again
+                for (auto& w : task->waiting)
+                    waiting.push_back(std::move(w));
+                task->waiting.clear();
+                continue;
+            }
+            if (!task->writing) {
+                read_blocking(task->path);
+                finish(*task);
+                continue;
+            }
+            if (task->step == Step::open_dir || task->step == Step::sync_dir || task->step == Step::close_dir) {
+                // renamed, only the folder sync and the done line are missing
+                finish_journaled(*task);
+                continue;
+            }
+            ::unlink(task->temp.c_str());
+            abandoned_temps.push_back(task->temp);
+            report_failure(task->path, std::runtime_error("io_uring failed: " + std::string(e.what())));
+            finish(*task);
+        }
+        in_flight.clear();
+        journal_lines.clear();
+        journal_busy = false;
+        for (auto& task : waiting) {
+            if (task->step == Step::close) {
+                try {
+                    active_journal->record("ready", task->path);
+                    fs::rename(task->temp, task->path);
+                } catch (const std::exception& error) {
+                    ::unlink(task->temp.c_str());
+                    report_failure(task->path, error);
+                    finish(*task);
+                    continue;
+                }
+            }
+            finish_journaled(*task);
+        }
+    }
+
+    // the blocking end of a write that abandon_ring found renamed
+    void finish_journaled(Task& task) {
+        try {
+            sync_path(task.path.parent_path().empty() ? fs::path(".") : task.path.parent_path(), O_RDONLY | O_DIRECTORY);
+            active_journal->record("done", task.path);
+        } catch (const std::exception& error) {
+            report_failure(task.path, error);
+            finish(task);
+            return;
+        }
+        written_out(task);
+    }
+
+    IoUring& ring;
+    PathStream& image_paths;
+    StageQueue<LoadedFile>& loaded;
+    StageQueue<EncodedFile>& written;
+
+    size_t next_path = 0;
+    bool loaded_closed = false;
+    unsigned reads_active = 0;
+    unsigned writes_active = 0;
+    std::deque<LoadedFile> ready;  // loaded, waiting for room in `loaded`
+    std::unordered_set<Task*> in_flight;
+    bool broken = false;  // the ring failed, the rest is done with blocking I/O
+    std::vector<fs::path> abandoned_temps;  // of writes the ring failed during
+
+    // journal lines not yet written, and the writes waiting for them
+    std::string journal_lines;
+    std::vector<std::unique_ptr<Task>> journal_waiting;
+    bool journal_busy = false;  // a batch is being written and synced
+};
+
+// An io_uring with the operations UringFileIo needs, or nullptr if the kernel
+// cannot provide one; the pipeline then does its I/O on blocking threads.
+inline std::unique_ptr<IoUring> open_pipeline_ring() {
+    try {
+        auto ring = std::make_unique<IoUring>(4 * URING_FILES_IN_FLIGHT);
+        if (!ring->supports({IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_FSYNC,
+                             IORING_OP_CLOSE, IORING_OP_RENAMEAT}))
+            throw std::runtime_error("kernel lacks the file operations");
+        return ring;
+    } catch (const std::exception& e) {
+        std::cerr << "io_uring unavailable (" << e.what() << "), using blocking I/O" << std::endl;
+        return nullptr;
+    }
+}
+
+template <typename T>
+inline void print_queue_depth(std::ostream& out, const StageQueue<T>& queue) {
+    out << " " << queue.name << " " << queue.depth() << "/" << queue.capacity();
+}
+
+template <typename T>
+inline void print_queue_summary(std::ostream& out, const StageQueue<T>& queue) {
+    out << "  " << queue.name << ": peak " << queue.peak_depth.load() << "/" << queue.capacity()
+        << ", producer waits " << queue.full_waits.load()
+        << ", consumer waits " << queue.empty_waits.load() << std::endl;
+}
+
+// Read -> decode -> rotate -> encode/write, each stage on its own group of
+// threads and connected by bounded lock-free queues. File I/O then overlaps
+// with inflate, rotation and deflate, and each group can be sized to the
+// bottleneck. A queue that is often full points at a slow stage after it,
+// one that is often empty at a slow stage before it. The rotate stage makes
+// every entry of outputs from each decoded image. Paths are taken from
+// image_paths as they arrive, until it is closed.
+inline void run_pipeline(PathStream& image_paths, PipelineOptions options, int cores,
+                         const std::vector<RotationOutput>& outputs) {
+    resolve_pipeline_threads(options, cores);
+
+    // with io_uring one thread does all the file I/O, reads and writes
+    std::unique_ptr<IoUring> ring = options.io_uring ? open_pipeline_ring() : nullptr;
+
+    StageQueue<LoadedFile> read_queue("read->decode", options.queue_depth, ring ? 1 : options.read_threads);
+    StageQueue<DecodedImage> decode_queue("decode->rotate", options.queue_depth, options.decode_threads);
+    StageQueue<DecodedImage> rotate_queue("rotate->encode", options.queue_depth, options.rotate_threads);
+    StageQueue<EncodedFile> write_queue("encode->write", options.queue_depth, options.encode_threads);
+
+    std::atomic<size_t> next_path{0};
+    Prefetcher prefetcher(image_paths);
+    std::vector<std::thread> threads;
+    if (ring) {
+        threads.emplace_back([&]() { UringFileIo(*ring, image_paths, read_queue, write_queue).run(); });
+    }
+    for (int i = 0; i < (ring ? 0 : options.read_threads); ++i) {
+        threads.emplace_back([&]() {
+            fs::path path;
+            for (size_t k; image_paths.wait(k = next_path.fetch_add(1, std::memory_order_relaxed), path);) {
+                prefetcher.advance(k);
+                LoadedFile file;
+                file.path = std::move(path);
+                try {
+                    file.contents.load(file.path.c_str());
+                } catch (const std::exception& e) {
+                    report_failure(file.path, e);
+                    continue;
+                }
+                read_queue.push(std::move(file));
+            }
+            read_queue.producer_done();
+        });
+    }
+    for (int i = 0; i < options.decode_threads; ++i) {
+        threads.emplace_back([&]() {
+            LoadedFile file;
+            while (read_queue.pop(file)) {
+                DecodedImage decoded;
+                decoded.path = std::move(file.path);
+                if (active_dedup) {
+                    // an input seen before has its outputs written right here
+                    std::vector<DedupKey> keys = dedup_keys(file.contents.data(), file.contents.size(), outputs);
+                    try {
+                        if (write_cached_outputs(decoded.path, outputs, keys))
+                            continue;
+                    } catch (const std::exception& e) {
+                        report_failure(decoded.path, e);
+                        continue;
+                    }
+                    active_dedup->count_misses(outputs.size());
+                    decoded.key = keys[0];
+                }
+                try {
+                    decode_png(file.contents.data(), file.contents.size(), decoded.image);
+                } catch (const std::exception& e) {
+                    report_failure(decoded.path, e);
+                    continue;
+                }
+                decode_queue.push(std::move(decoded));
+            }
+            decode_queue.producer_done();
+        });
+    }
+    for (int i = 0; i < options.rotate_threads; ++i) {
+        threads.emplace_back([&]() {
+            DecodedImage decoded;
+            while (decode_queue.pop(decoded)) {
+                // every output comes from the one decoded source
+                for (const auto& output : outputs) {
+                    DecodedImage rotated;
+                    rotated.path = output_path_for(decoded.path, output);
+                    rotated.key = DedupKey{decoded.key.input, transform_hash(output.transform)};
+                    try {
+                        rotated.image = timed(Stage::rotate, [&]() { return output.rotate(decoded.image); });
+                    } catch (const std::exception& e) {
+                        report_failure(rotated.path, e);
+                        continue;
+                    }
+                    rotate_queue.push(std::move(rotated));
+                }
+                decoded.image = Image();
+            }
+            rotate_queue.producer_done();
+        });
+    }
+    for (int i = 0; i < options.encode_threads; ++i) {
+        threads.emplace_back([&]() {
+            DecodedImage rotated;
+            std::vector<unsigned char> bytes;
+            while (rotate_queue.pop(rotated)) {
+                try {
+                    encode_png(rotated.image, bytes);
+                    if (active_dedup)
+                        active_dedup->store(rotated.key, bytes);
+                    if (ring) {
+                        write_queue.push(EncodedFile{std::move(rotated.path), std::move(bytes)});
+                        bytes = std::vector<unsigned char>();
+                    } else {
+                        replace_file(rotated.path, [&](const fs::path& temp) { write_file(temp.c_str(), bytes); });
+                    }
+                } catch (const std::exception& e) {
+                    report_failure(rotated.path, e);
+                }
+                rotated.image = Image();
+            }
+            write_queue.producer_done();
+        });
+    }
+
+    // sample the queue depths once a second
+    std::mutex monitor_mutex;
+    std::condition_variable monitor_stop;
+    bool done = false;
+    std::thread monitor;
+    if (options.stats) {
+        monitor = std::thread([&]() {
+            std::unique_lock<std::mutex> lock(monitor_mutex);
+            while (!monitor_stop.wait_for(lock, std::chrono::seconds(1), [&]() { return done; })) {
+                std::cerr << "pipeline:";
+                print_queue_depth(std::cerr, read_queue);
+                print_queue_depth(std::cerr, decode_queue);
+                print_queue_depth(std::cerr, rotate_queue);
+                if (ring)
+                    print_queue_depth(std::cerr, write_queue);
+                std::cerr << std::endl;
+            }
+        });
+    }
+
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    if (options.stats) {
+        {
+            std::lock_guard<std::mutex> lock(monitor_mutex);
+            done = true;
+        }
+        monitor_stop.notify_all();
+        monitor.join();
+        std::cerr << "pipeline threads: " << (ring ? "io_uring 1" : "read " + std::to_string(options.read_threads))
+                  << ", decode " << options.decode_threads
+                  << ", rotate " << options.rotate_threads << ", encode " << options.encode_threads << std::endl;
+        print_queue_summary(std::cerr, read_queue);
+        print_queue_summary(std::cerr, decode_queue);
+        print_queue_summary(std::cerr, rotate_queue);
+        if (ring)
+            print_queue_summary(std::cerr, write_queue);
+    }
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+
+#include "image.h"
+#include "parallel.h"
+
+// Images keep the pixel format of their PNG through the lossless kernels.
+// Arbitrary angles need a transparent value for the uncovered corners and
+// interpolation works on RGBA, so those engines convert their source first,
+// and only when its own format lacks what they need.
+
+// 8-bit value of a gray sample of bit_depth bits (as png_set_expand_gray_1_2_4_to_8)
+inline unsigned char scale_gray(unsigned char v, int bit_depth) {
+    return bit_depth >= 8 ? v : static_cast<unsigned char>(v * 255 / ((1 << bit_depth) - 1));
+}
+
+// one row of n pixels of format f as RGBA with samples of type T
+template <typename T>
+inline void row_to_rgba(const PixelFormat& f, const unsigned char* row, T* d, int n) {
+    constexpr T opaque = std::numeric_limits<T>::max();
+    const T* s = reinterpret_cast<const T*>(row);
+    switch (f.layout) {
+    case PixelLayout::rgba:
+        std::memcpy(d, s, static_cast<size_t>(n) * 4 * sizeof(T));
+        break;
+    case PixelLayout::rgb:
+        for (int x = 0; x < n; ++x, s += 3, d += 4) {
+            d[0] = s[0];
+            d[1] = s[1];
+            d[2] = s[2];
+            d[3] = opaque;
+        }
+        break;
+    case PixelLayout::gray_alpha:
+        for (int x = 0; x < n; ++x, s += 2, d += 4) {
+            d[0] = d[1] = d[2] = s[0];
+            d[3] = s[1];
+        }
+        break;
+    case PixelLayout::gray:
+        for (int x = 0; x < n; ++x, s += 1, d += 4) {
+            d[0] = d[1] = d[2] = sizeof(T) == 1 ? scale_gray(static_cast<unsigned char>(s[0]), f.bit_depth) : s[0];
+            d[3] = opaque;
+        }
+        break;
+    case PixelLayout::palette:
+        for (int x = 0; x < n; ++x, s += 1, d += 4) {
+            const auto& e = f.palette->entries[s[0]];
+            std::copy(e.begin(), e.end(), d);
+        }
+        break;
+    }
+}
+
+// the pixels of image as RGBA, 16-bit for a 16-bit image and 8-bit otherwise
+inline Image to_rgba(const Image& image) {
+    const PixelFormat& f = image.format;
+    Image rgba(image.width, image.height, rgba_format(f.bit_depth == 16 ? 16 : 8));
+    with_sample_type(rgba.format, [&](auto sample) {
+        using T = decltype(sample);
+        parallel_rows(image.height, image.width, 1, [&](int row_begin, int row_end) {
+            for (int y = row_begin; y < row_end; ++y) {
+                row_to_rgba<T>(f, image.row(y), reinterpret_cast<T*>(rgba.row(y)), image.width);
+            }
+        });
+    });
+    return rgba;
+}
+
+// image itself when it is RGBA, otherwise its RGBA copy in converted
+inline const Image& rgba_source(const Image& image, Image& converted) {
+    if (image.format.layout == PixelLayout::rgba)
+        return image;
+    converted = to_rgba(image);
+    return converted;
+}
+
+// The format closest to f whose fill is transparent black: RGB gains an alpha
+// channel, gray becomes gray + alpha (8-bit below 16), and a palette gets a
+// transparent entry appended (RGBA once all 256 entries are taken).
+inline PixelFormat transparent_format(const PixelFormat& f) {
+    if (f.has_transparent_fill())
+        return f;
+    PixelFormat t = rgba_format(f.bit_depth == 16 ? 16 : 8);
+    if (f.layout == PixelLayout::gray) {
+        t.layout = PixelLayout::gray_alpha;
+    } else if (f.layout == PixelLayout::palette && f.palette && f.palette->size < 256) {
+        auto palette = std::make_shared<Palette>(*f.palette);
+        t.layout = PixelLayout::palette;
+        t.fill = static_cast<unsigned char>(palette->size);
+        palette->entries[palette->size++] = {0, 0, 0, 0};
+        t.bit_depth = f.bit_depth;
+        while ((1 << t.bit_depth) < palette->size)
+            t.bit_depth *= 2;
+        t.palette = std::move(palette);
+    }
+    return t;
+}
+
+// image itself when its fill is transparent, otherwise a copy in converted
+// whose format (transparent_format) has one
+inline const Image& with_transparency(const Image& image, Image& converted) {
+    const PixelFormat& f = image.format;
+    if (f.has_transparent_fill())
+        return image;
+    PixelFormat t = transparent_format(f);
+    if (t.layout == PixelLayout::rgba) {
+        converted = to_rgba(image);
+        return converted;
+    }
+    converted.allocate(image.width, image.height, std::move(t));
+    if (f.layout == PixelLayout::palette) {
+        for (int y = 0; y < image.height; ++y) {
+            std::memcpy(converted.row(y), image.row(y), image.width);
+        }
+        return converted;
+    }
+    with_sample_type(f, [&](auto sample) {
+        using T = decltype(sample);
+        parallel_rows(image.height, image.width, 1, [&](int row_begin, int row_end) {
+            for (int y = row_begin; y < row_end; ++y) {
+                const T* s = reinterpret_cast<const T*>(image.row(y));
+                T* d = reinterpret_cast<T*>(converted.row(y));
+                for (int x = 0; x < image.width; ++x, ++s, d += 2) {
+                    d[0] = sizeof(T) == 1 ? scale_gray(static_cast<unsigned char>(s[0]), f.bit_depth) : s[0];
+                    d[1] = std::numeric_limits<T>::max();
+                }
+            }
+        });
+    });
+    return converted;
+}
@@ -0,0 +1,518 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <png.h>
+
+#include "encode_profile.h"
+#include "file_io.h"
+#include "image.h"
+#include "transpose.h"
+
+// libpng reports errors through this handler, which keeps the message for the
+// exception thrown once control is back at the setjmp landing
+struct PngError {
+    char message[256] = "unknown libpng error";
+};
+
+inline void png_error_handler(png_structp png, png_const_charp message) {
+    PngError* error = static_cast<PngError*>(png_get_error_ptr(png));
+    std::snprintf(error->message, sizeof(error->message), "%s", message);
+    png_longjmp(png, 1);
+}
+
+// libpng and zlib allocate their state anew for every image: the png and info
+// structs, the inflate window or the deflate hash chains, row and filter
+// buffers. A read or write struct cannot be reset for another image, so its
+// memory is recycled instead: every allocation is bumped out of one block of
+// the thread's arena, and the block is rewound once the struct is destroyed
+// and everything it held is freed. Whatever did not fit went to malloc; the
+// block then grows to the whole demand, so after the first images a thread
+// codes PNGs without touching the heap.
+class PngArena {
+public:
+    PngArena() = default;
+    PngArena(const PngArena&) = delete;
+    PngArena& operator=(const PngArena&) = delete;
+    ~PngArena() {
+        free_spilled();
+        std::free(block);
+    }
+
+    void* allocate(size_t bytes) {
+        bytes = (bytes + ALIGN - 1) / ALIGN * ALIGN;
+        void* p;
+        if (capacity - used >= bytes) {
+            p = block + used;
+            used += bytes;
+        } else {
+            // header keeps the chain of spilled blocks, padded to ALIGN
+            unsigned char* spill = static_cast<unsigned char*>(std::malloc(ALIGN + bytes));
+            if (!spill)
+                return nullptr;
+            *reinterpret_cast<unsigned char**>(spill) = spilled;
+            spilled = spill;
+            spilled_bytes += bytes;
+            p = spill + ALIGN;
+        }
+        ++live;
+        return p;
+    }
+
+    void free(void* p) {
+        if (p && --live == 0)
+            rewind();
+    }
+
+private:
+    static constexpr size_t ALIGN = alignof(std::max_align_t);
+
+    void rewind() {
+        if (spilled) {
+            size_t demand = used + spilled_bytes;
+            free_spilled();
+            std::free(block);
+            block = static_cast<unsigned char*>(std::malloc(demand));
+            capacity = block ? demand : 0;
+        }
+        used = 0;
+    }
+
+    void free_spilled() {
+        while (spilled) {
+            unsigned char* next = *reinterpret_cast<unsigned char**>(spilled);
+            std::free(spilled);
+            spilled = next;
+        }
+        spilled_bytes = 0;
+    }
+
+    unsigned char* block = nullptr;
+    size_t capacity = 0;
+    size_t used = 0;
+    unsigned char* spilled = nullptr;  // blocks from malloc, newest first
+    size_t spilled_bytes = 0;
+    size_t live = 0;  // allocations not freed yet
+};
+
+inline png_voidp png_arena_malloc(png_structp png, png_alloc_size_t size) {
+    return static_cast<PngArena*>(png_get_mem_ptr(png))->allocate(size);
+}
+
+inline void png_arena_free(png_structp png, png_voidp p) {
+    static_cast<PngArena*>(png_get_mem_ptr(png))->free(p);
+}
+
+inline PngArena& thread_png_arena() {
+    thread_local PngArena arena;
+    return arena;
+}
+
+// read and write structs that allocate from the thread's arena
+inline png_structp create_png_read_struct(PngError& error) {
+    return png_create_read_struct_2(PNG_LIBPNG_VER_STRING, &error, png_error_handler, NULL, &thread_png_arena(),
+                                    png_arena_malloc, png_arena_free);
+}
+
+inline png_structp create_png_write_struct(PngError& error) {
+    return png_create_write_struct_2(PNG_LIBPNG_VER_STRING, &error, png_error_handler, NULL, &thread_png_arena(),
+                                     png_arena_malloc, png_arena_free);
+}
+
+// PNG stores 16-bit samples big-endian, Image keeps them in host order
+inline void set_host_byte_order(png_structp png) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    png_set_swap(png);
+#else
+    (void)png;
+#endif
+}
+
+// Set up libpng to deliver the image in its own colour type and bit depth, one
+// sample per byte below 8 bits, and return the format it arrives in. Only what
+// the Image layouts cannot hold is converted: a tRNS colour key on gray or RGB
+// becomes an alpha channel. Palettes (with their tRNS alpha) are kept; the
+// first transparent black entry, if any, becomes the fill.
+inline PixelFormat set_native_transforms(png_structp png, png_infop info) {
+    png_byte color_type = png_get_color_type(png, info);
+    png_byte bit_depth = png_get_bit_depth(png, info);
+    bool key = color_type != PNG_COLOR_TYPE_PALETTE && png_get_valid(png, info, PNG_INFO_tRNS);
+
+    PixelFormat format;
+    format.bit_depth = bit_depth == 16 ? 16 : bit_depth < 8 && !key ? bit_depth : 8;
+    if (bit_depth == 16)
+        set_host_byte_order(png);
+    if (bit_depth < 8)
+        png_set_packing(png);
+
+    switch (color_type) {
+    case PNG_COLOR_TYPE_GRAY:
+        format.layout = key ? PixelLayout::gray_alpha : PixelLayout::gray;
+        break;
+    case PNG_COLOR_TYPE_GRAY_ALPHA:
+        format.layout = PixelLayout::gray_alpha;
+        break;
+    case PNG_COLOR_TYPE_RGB:
+        format.layout = key ? PixelLayout::rgba : PixelLayout::rgb;
+        break;
+    case PNG_COLOR_TYPE_PALETTE: {
+        format.layout = PixelLayout::palette;
+        auto palette = std::make_shared<Palette>();
+        png_colorp colors = nullptr;
+        int colors_count = 0;
+        png_get_PLTE(png, info, &colors, &colors_count);
+        png_bytep alpha = nullptr;
+        int alpha_count = 0;
+        if (png_get_valid(png, info, PNG_INFO_tRNS))
+            png_get_tRNS(png, info, &alpha, &alpha_count, nullptr);
+        for (int i = 0; i < 256; ++i) {
+            auto& e = palette->entries[i];
+            bool valid = i < colors_count;
+            e = {valid ? colors[i].red : png_byte(0), valid ? colors[i].green : png_byte(0),
+                 valid ? colors[i].blue : png_byte(0), i < alpha_count ? alpha[i] : png_byte(255)};
+        }
+        palette->size = colors_count;
+        for (int i = 0; i < colors_count; ++i) {
+            if (palette->entries[i] == std::array<unsigned char, 4>{0, 0, 0, 0}) {
+                format.fill = static_cast<unsigned char>(i);
+                break;
+            }
+        }
+        format.palette = std::move(palette);
+        break;
+    }
+    default:
+        format.layout = PixelLayout::rgba;
+        break;
+    }
+    if (key) {
+        png_set_tRNS_to_alpha(png);
+        if (color_type == PNG_COLOR_TYPE_RGB)
+            png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+    }
+    return format;
+}
+
+// Decode the image behind an initialized read struct straight into the rows of
+// image. The caller's setjmp handles libpng errors; format and row_pointers
+// belong to the caller so that a longjmp out of here does not skip their
+// destructors (a palette would leak), and row_pointers is reused across images.
+inline void read_png_rows(png_structp png, png_infop info, Image& image, PixelFormat& format,
+                          std::vector<png_bytep>& row_pointers) {
+    png_read_info(png, info);
+
+    int width = png_get_image_width(png, info);
+    int height = png_get_image_height(png, info);
+
+    format = set_native_transforms(png, info);
+    png_set_interlace_handling(png);
+
+    png_read_update_info(png, info);
+
+    image.allocate(width, height, std::move(format));
+
+    // Point libpng directly at the rows of the image buffer
+    row_pointers.resize(height);
+    for (int y = 0; y < height; y++) {
+        row_pointers[y] = image.row(y);
+    }
+    png_read_image(png, row_pointers.data());
+}
+
+inline int png_color_type(PixelLayout layout) {
+    switch (layout) {
+    case PixelLayout::rgb:
+        return PNG_COLOR_TYPE_RGB;
+    case PixelLayout::gray_alpha:
+        return PNG_COLOR_TYPE_GRAY_ALPHA;
+    case PixelLayout::gray:
+        return PNG_COLOR_TYPE_GRAY;
+    case PixelLayout::palette:
+        return PNG_COLOR_TYPE_PALETTE;
+    default:
+        return PNG_COLOR_TYPE_RGBA;
+    }
+}
+
+// encode image through an initialized write struct, see read_png_rows
+inline void write_png_rows(png_structp png, png_infop info, const Image& image, std::vector<png_bytep>& row_pointers,
+                           const EncodeSettings& settings) {
+    const PixelFormat& format = image.format;
+    png_set_IHDR(png, info, image.width, image.height, format.bit_depth, png_color_type(format.layout),
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    if (format.layout == PixelLayout::palette) {
+        const Palette& palette = *format.palette;
+        png_color colors[256];
+        png_byte alpha[256];
+        int alpha_count = 0;  // tRNS stops after the last entry that is not opaque
+        for (int i = 0; i < palette.size; ++i) {
+            colors[i] = {palette.entries[i][0], palette.entries[i][1], palette.entries[i][2]};
+            alpha[i] = palette.entries[i][3];
+            if (alpha[i] != 255)
+                alpha_count = i + 1;
+        }
+        png_set_PLTE(png, info, colors, palette.size);
+        if (alpha_count > 0)
+            png_set_tRNS(png, info, alpha, alpha_count, nullptr);
+    }
+    apply_encode_settings(png, settings);
+    png_write_info(png, info);
+    if (format.bit_depth < 8)
+        png_set_packing(png);
+    if (format.bit_depth == 16)
+        set_host_byte_order(png);
+
+    row_pointers.resize(image.height);
+    for (int y = 0; y < image.height; y++) {
+        row_pointers[y] = const_cast<png_bytep>(image.row(y));
+    }
+    png_write_image(png, row_pointers.data());
+    png_write_end(png, NULL);
+}
+
+// PNG coding works on memory buffers: whole files are loaded and written with
+// single system calls (file_io.h) instead of many small stdio transfers.
+
+struct PngMemoryReader {
+    const unsigned char* data;
+    size_t size;
+    size_t offset;
+};
+
+inline void png_memory_read(png_structp png, png_bytep out, png_size_t length) {
+    PngMemoryReader* reader = static_cast<PngMemoryReader*>(png_get_io_ptr(png));
+    if (length > reader->size - reader->offset)
+        png_error(png, "unexpected end of PNG data");
+    std::memcpy(out, reader->data + reader->offset, length);
+    reader->offset += length;
+}
+
+inline void png_memory_write(png_structp png, png_bytep data, png_size_t length) {
+    std::vector<unsigned char>* bytes = static_cast<std::vector<unsigned char>*>(png_get_io_ptr(png));
+    bytes->insert(bytes->end(), data, data + length);
+}
+
+inline void png_memory_flush(png_structp) {}
+
+// decode size bytes of PNG data into an image of its own pixel format
+inline void decode_png(const unsigned char* data, size_t size, Image& image) {
+    StageTimer timer(Stage::decode);
+    PngError error;
+    png_structp png = create_png_read_struct(error);
+    if (!png) {
+        throw std::runtime_error("png_create_read_struct failed.");
+    }
+
+    png_infop info = png_create_info_struct(png);
+    if (!info) {
+        png_destroy_read_struct(&png, NULL, NULL);
+        throw std::runtime_error("png_create_info_struct failed.");
+    }
+
+    PixelFormat format;
+    thread_local std::vector<png_bytep> row_pointers;
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_read_struct(&png, &info, NULL);
+        throw std::runtime_error(std::string("error during read_image: ") + error.message);
+    }
+
+    PngMemoryReader reader = {data, size, 0};
+    png_set_read_fn(png, &reader, png_memory_read);
+    read_png_rows(png, info, image, format, row_pointers);
+
+    png_destroy_read_struct(&png, &info, NULL);
+    count(Counter::pixels, static_cast<uint64_t>(image.width) * image.height);
+}
+
+// Encode an image into PNG bytes of its pixel format with the settings of profile.
+// libpng appends to bytes as it goes, so reusing the vector across images
+// avoids regrowing it. Every encode is counted in encode_stats.
+inline void encode_png(const Image& image, std::vector<unsigned char>& bytes,
+                       EncodeProfile profile = active_encode_profile) {
+    StageTimer timer(Stage::encode);
+    auto start = std::chrono::steady_clock::now();
+
+    PngError error;
+    png_structp png = create_png_write_struct(error);
+    if (!png) {
+        throw std::runtime_error("png_create_write_struct failed.");
+    }
+
+    png_infop info = png_create_info_struct(png);
+    if (!info) {
+        png_destroy_write_struct(&png, NULL);
+        throw std::runtime_error("png_create_info_struct failed.");
+    }
+
+    thread_local std::vector<png_bytep> row_pointers;
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_write_struct(&png, &info);
+        throw std::runtime_error(std::string("error during writing: ") + error.message);
+    }
+
+    bytes.clear();
+    png_set_write_fn(png, &bytes, png_memory_write, png_memory_flush);
+    write_png_rows(png, info, image, row_pointers, encode_settings(profile, image));
+
+    png_destroy_write_struct(&png, &info);
+
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    encode_stats.images += 1;
+    encode_stats.raw_bytes += static_cast<uint64_t>(image.width) * image.height * image.pixel_bytes;
+    encode_stats.png_bytes += bytes.size();
+    encode_stats.nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+}
+
+// read a PNG file into an image, decoding straight into its rows
+inline void read_png_file(const char* filename, Image& image) {
+    FileData file;
+    file.load(filename);
+    decode_png(file.data(), file.size(), image);
+}
+
+// write an image to a PNG file with a single write
+inline void write_png_file(const char* filename, const Image& image) {
+    thread_local std::vector<unsigned char> bytes;
+    encode_png(image, bytes);
+    write_file(filename, bytes);
+}
+
+// state shared by the progressive-reader callbacks of read_png_file_rotated_90
+struct RotatingReader {
+    Image* rotated;
+    int width = 0;   // of the source image
+    int height = 0;
+    bool interlaced = false;
+    bool finished = false;  // libpng has seen the end of the image
+    PixelFormat format;     // kept here, where a libpng longjmp still destroys it
+    Image scratch_row;  // one row, for merging interlaced passes
+
+    // non-interlaced rows are collected into a band of TRANSPOSE_TILE rows
+    // that is then moved into the output with the blocked transpose
+    Image band;
+    int band_start = 0;
+};
+
+// move the collected band rows [band_start, row_end) into their output columns
+inline void flush_rotating_band(RotatingReader* reader, int row_end) {
+    int rows = row_end - reader->band_start;
+    if (rows <= 0)
+        return;
+    int first_column = reader->height - reader->band_start - rows;
+    Image& rotated = *reader->rotated;
+    with_pixel_bytes(rotated.pixel_bytes, [&](auto bytes) {
+        constexpr int Bytes = decltype(bytes)::value;
+        transpose_rows<false, true, Bytes>(reader->band.data(), reader->band.stride, reader->width, rows,
+                                           rotated.data() + static_cast<size_t>(first_column) * Bytes, rotated.stride,
+                                           0, reader->width);
+    });
+    reader->band_start = row_end;
+}
+
+inline void rotating_reader_info(png_structp png, png_infop info) {
+    RotatingReader* reader = static_cast<RotatingReader*>(png_get_progressive_ptr(png));
+
+    reader->width = png_get_image_width(png, info);
+    reader->height = png_get_image_height(png, info);
+
+    PixelFormat& format = reader->format;
+    format = set_native_transforms(png, info);
+
+    reader->interlaced = png_set_interlace_handling(png) > 1;
+    png_read_update_info(png, info);
+
+    // The source row y becomes column height - 1 - y of the output
+    reader->rotated->allocate(reader->height, reader->width, format);
+    if (reader->interlaced) {
+        reader->rotated->clear();
+        reader->scratch_row.allocate(reader->width, 1, format);
+    } else {
+        reader->band.allocate(reader->width, std::min(TRANSPOSE_TILE, reader->height), std::move(format));
+    }
+}
+
+inline void rotating_reader_row(png_structp png, png_bytep new_row, png_uint_32 row_num, int) {
+    if (!new_row)
+        return;
+
+    RotatingReader* reader = static_cast<RotatingReader*>(png_get_progressive_ptr(png));
+
+    if (!reader->interlaced) {
+        int y = static_cast<int>(row_num);
+        std::memcpy(reader->band.row(y - reader->band_start), new_row,
+                    static_cast<size_t>(reader->width) * reader->band.pixel_bytes);
+        if (y + 1 - reader->band_start == reader->band.height || y + 1 == reader->height) {
+            flush_rotating_band(reader, y + 1);
+        }
+        return;
+    }
+
+    // Interlaced passes only deliver some pixels of the row, so merge them
+    // with what earlier passes already left in the output column
+    Image& rotated = *reader->rotated;
+    int column = reader->height - 1 - static_cast<int>(row_num);
+    unsigned char* row = reader->scratch_row.row(0);
+    int bytes = rotated.pixel_bytes;
+    for (int x = 0; x < reader->width; x++) {
+        std::memcpy(row + x * bytes, rotated.pixel(column, x), bytes);
+    }
+    png_progressive_combine_row(png, row, new_row);
+    for (int x = 0; x < reader->width; x++) {
+        std::memcpy(rotated.pixel(column, x), row + x * bytes, bytes);
+    }
+}
+
+inline void rotating_reader_end(png_structp png, png_infop) {
+    static_cast<RotatingReader*>(png_get_progressive_ptr(png))->finished = true;
+}
+
+// Decode size bytes of PNG data and rotate the image 90 degrees to the right
+// while it is being decoded. Rows are handed over by libpng as they are produced
+// and moved into their output columns a small band at a time, so the unrotated
+// image is never held in memory. Timed as decode, the rotation has no stage of
+// its own here.
+inline void decode_png_rotated_90(const unsigned char* data, size_t size, Image& rotated) {
+    StageTimer timer(Stage::decode);
+    PngError error;
+    png_structp png = create_png_read_struct(error);
+    if (!png) {
+        throw std::runtime_error("png_create_read_struct failed.");
+    }
+
+    png_infop info = png_create_info_struct(png);
+    if (!info) {
+        png_destroy_read_struct(&png, NULL, NULL);
+        throw std::runtime_error("png_create_info_struct failed.");
+    }
+
+    RotatingReader reader;
+    reader.rotated = &rotated;
+
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_read_struct(&png, &info, NULL);
+        throw std::runtime_error(std::string("error during progressive read: ") + error.message);
+    }
+
+    png_set_progressive_read_fn(png, &reader, rotating_reader_info, rotating_reader_row, rotating_reader_end);
+
+    // the progressive reader takes the whole file at once, rows still come out one by one
+    png_process_data(png, info, const_cast<png_bytep>(data), size);
+    if (!reader.finished)
+        png_error(png, "unexpected end of PNG data");
+
+    png_destroy_read_struct(&png, &info, NULL);
+    count(Counter::pixels, static_cast<uint64_t>(rotated.width) * rotated.height);
+}
+
+// read a PNG file and rotate it 90 degrees to the right while it is being decoded
+inline void read_png_file_rotated_90(const char* filename, Image& rotated) {
+    FileData file;
+    file.load(filename);
+    decode_png_rotated_90(file.data(), file.size(), rotated);
+}
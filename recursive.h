@@ -0,0 +1,170 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+#include "image.h"
+#include "pixel_format.h"
+#include "resample.h"
+#include "rotate.h"
+
+// The recursive rotations of v2rec.cpp and v3rec.cpp. Both are cache-oblivious:
+// the output is split into quadrants until a block is at most
+// RECURSIVE_BLOCK x RECURSIVE_BLOCK pixels, which is then filled by a plain
+// loop. Whatever the cache sizes, some level of the recursion works on blocks
+// (and the source area they read) that fit each of them, and the depth only
+// grows with the logarithm of the image size.
+
+// 32x32 RGBA pixels are 4 KB, so a base block and the source it reads sit in L1
+constexpr int RECURSIVE_BLOCK = 32;
+
+// Split the output block [x0, x1) x [y0, y1) into quadrants (halves once one
+// side is down to RECURSIVE_BLOCK) and call base on every leaf. A block for
+// which skip returns true is left out with everything inside it.
+template <typename Skip, typename Base>
+inline void rotate_quadrants(int x0, int x1, int y0, int y1, const Skip& skip, const Base& base) {
+    if (x0 >= x1 || y0 >= y1 || skip(x0, x1, y0, y1))
+        return;
+    bool split_x = x1 - x0 > RECURSIVE_BLOCK;
+    bool split_y = y1 - y0 > RECURSIVE_BLOCK;
+    if (!split_x && !split_y) {
+        base(x0, x1, y0, y1);
+        return;
+    }
+    int xm = split_x ? x0 + (x1 - x0) / 2 : x1;
+    int ym = split_y ? y0 + (y1 - y0) / 2 : y1;
+    rotate_quadrants(x0, xm, y0, ym, skip, base);
+    rotate_quadrants(xm, x1, y0, ym, skip, base);
+    rotate_quadrants(x0, xm, ym, y1, skip, base);
+    rotate_quadrants(xm, x1, ym, y1, skip, base);
+}
+
+// Function to rotate the image 90 degrees to the right using recursion (v2rec.cpp)
+inline Image rotate_image_recursive_90(const Image& image_data) {
+    Image rotated_image(image_data.height, image_data.width, image_data.format);
+    int last_row = image_data.height - 1;
+    // output (x, y) comes from source (y, height - 1 - x)
+    with_pixel_bytes(image_data.pixel_bytes, [&](auto bytes) {
+        constexpr int Bytes = decltype(bytes)::value;
+        rotate_quadrants(0, rotated_image.width, 0, rotated_image.height, [](int, int, int, int) { return false; },
+                         [&](int x0, int x1, int y0, int y1) {
+                             for (int y = y0; y < y1; ++y) {
+                                 unsigned char* out = rotated_image.pixel(x0, y);
+                                 for (int x = x0; x < x1; ++x, out += Bytes) {
+                                     copy_pixel<Bytes>(out, image_data.pixel(y, last_row - x));
+                                 }
+                             }
+                         });
+    });
+    return rotated_image;
+}
+
+// Output pixel (x, y) is taken from source position (u, v), mapped from
+// (x + offset, y + offset) as in row_span; (u_lo..u_hi, v_lo..v_hi) is the
+// range of (u, v) over an output block. The mapping is evaluated exactly as
+// per pixel and each of u and v only grows (or only shrinks) with x and with
+// y, so the range over a block is spanned by its corners.
+struct RecursiveMapping {
+    double cos_theta, sin_theta;
+    int cx, cy, new_cx, new_cy;
+    double offset;
+
+    double u(int x, int y) const {
+        return cos_theta * (x + offset - new_cx) + sin_theta * (y + offset - new_cy) + cx;
+    }
+    double v(int x, int y) const {
+        return -sin_theta * (x + offset - new_cx) + cos_theta * (y + offset - new_cy) + cy;
+    }
+
+    void range(int x0, int x1, int y0, int y1, double& u_lo, double& u_hi, double& v_lo, double& v_hi) const {
+        double us[4] = {u(x0, y0), u(x1 - 1, y0), u(x0, y1 - 1), u(x1 - 1, y1 - 1)};
+        double vs[4] = {v(x0, y0), v(x1 - 1, y0), v(x0, y1 - 1), v(x1 - 1, y1 - 1)};
+        u_lo = *std::min_element(us, us + 4);
+        u_hi = *std::max_element(us, us + 4);
+        v_lo = *std::min_element(vs, vs + 4);
+        v_hi = *std::max_element(vs, vs + 4);
+    }
+};
+
+// angle image rotation using recursion (v3rec.cpp)
+inline Image rotate_image_recursive(const Image& image_data, double angle_degrees, Interpolation interpolation) {
+    int width = image_data.width;
+    int height = image_data.height;
+
+    // nearest neighbour keeps the pixel format, interpolation works in RGBA
+    Image converted;
+    Image premultiplied;
+    if (interpolation != Interpolation::nearest)
+        premultiplied = premultiply_alpha(rgba_source(image_data, converted));
+    const Image& source = interpolation != Interpolation::nearest ? premultiplied
+                                                                  : with_transparency(image_data, converted);
+
+    double angle_rad = angle_degrees * M_PI / 180.0;
+    double cos_theta = cos(angle_rad);
+    double sin_theta = sin(angle_rad);
+
+    int cx = width / 2;
+    int cy = height / 2;
+
+    int new_width = static_cast<int>(std::abs(width * cos_theta) + std::abs(height * sin_theta));
+    int new_height = static_cast<int>(std::abs(width * sin_theta) + std::abs(height * cos_theta));
+
+    Image rotated_image(new_width, new_height, source.format);
+    rotated_image.clear();
+
+    RecursiveMapping m = {cos_theta, sin_theta, cx, cy, new_width / 2, new_height / 2,
+                          sample_offset(interpolation)};
+
+    // Blocks that map wholly outside the source stay transparent. Truncation
+    // toward zero still lands on the image down to -1 (exclusive), and the
+    // interpolation kernels reach `radius` pixels beyond the sample point, so
+    // this margin is never too small.
+    double margin = interpolation == Interpolation::nearest ? 1 : interpolation_radius(interpolation) + 1;
+    auto outside = [&](int x0, int x1, int y0, int y1) {
+        double u_lo, u_hi, v_lo, v_hi;
+        m.range(x0, x1, y0, y1, u_lo, u_hi, v_lo, v_hi);
+        return u_hi <= -margin || u_lo >= width + margin || v_hi <= -margin || v_lo >= height + margin;
+    };
+
+    if (interpolation == Interpolation::nearest) {
+        with_pixel_bytes(source.pixel_bytes, [&](auto bytes) {
+            constexpr int Bytes = decltype(bytes)::value;
+            rotate_quadrants(0, new_width, 0, new_height, outside, [&](int x0, int x1, int y0, int y1) {
+                for (int y = y0; y < y1; ++y) {
+                    for (int x = x0; x < x1; ++x) {
+                        int orig_x = static_cast<int>(m.u(x, y));
+                        int orig_y = static_cast<int>(m.v(x, y));
+                        if (orig_x >= 0 && orig_x < width && orig_y >= 0 && orig_y < height) {
+                            copy_pixel<Bytes>(rotated_image.pixel(x, y), source.pixel(orig_x, orig_y));
+                        }
+                    }
+                }
+            });
+        });
+        return rotated_image;
+    }
+
+    with_sample_type(source.format, [&](auto sample) {
+        using T = decltype(sample);
+        rotate_quadrants(0, new_width, 0, new_height, outside, [&](int x0, int x1, int y0, int y1) {
+            // the bounds test per tap is only needed where the kernel can leave the source
+            double u_lo, u_hi, v_lo, v_hi;
+            m.range(x0, x1, y0, y1, u_lo, u_hi, v_lo, v_hi);
+            bool inside = u_lo >= margin && u_hi < width - margin && v_lo >= margin && v_hi < height - margin;
+            for (int y = y0; y < y1; ++y) {
+                T* out = reinterpret_cast<T*>(rotated_image.pixel(x0, y));
+                for (int x = x0; x < x1; ++x) {
+                    int64_t u = to_fixed(m.u(x, y));
+                    int64_t v = to_fixed(m.v(x, y));
+                    if (inside) {
+                        sample_pixel<false>(source, u, v, interpolation, out + (x - x0) * 4);
+                    } else {
+                        sample_pixel<true>(source, u, v, interpolation, out + (x - x0) * 4);
+                    }
+                }
+                unpremultiply_pixels(out, x1 - x0);
+            }
+        });
+    });
+    return rotated_image;
+}
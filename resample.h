@@ -0,0 +1,450 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <type_traits>
+
+#include "image.h"
+#include "parallel.h"
+#include "simd.h"
+#include "span_kernels.h"
+
+enum class Interpolation {
+    nearest,
+    bilinear,
+    bicubic,
+};
+
+inline const char* interpolation_name(Interpolation interpolation) {
+    switch (interpolation) {
+    case Interpolation::bilinear:
+        return "bilinear";
+    case Interpolation::bicubic:
+        return "bicubic";
+    default:
+        return "nearest";
+    }
+}
+
+inline bool parse_interpolation(const std::string& name, Interpolation& interpolation) {
+    if (name == "nearest") {
+        interpolation = Interpolation::nearest;
+    } else if (name == "bilinear") {
+        interpolation = Interpolation::bilinear;
+    } else if (name == "bicubic") {
+        interpolation = Interpolation::bicubic;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// taps on each side of the sample point: the kernel reads source pixels
+// floor(p) - radius + 1 ... floor(p) + radius
+inline int interpolation_radius(Interpolation interpolation) {
+    return interpolation == Interpolation::bicubic ? 2 : 1;
+}
+
+// Weights use 8 fractional bits of the sample position and are 8-bit fixed
+// point themselves, so a 2D tap sum of 8-bit samples fits int32 lanes.
+constexpr int WEIGHT_BITS = 8;
+constexpr int WEIGHT_ONE = 1 << WEIGHT_BITS;
+
+// Keys cubic (a = -0.5) weights for the 4 taps at each of the 256 phases
+struct BicubicTable {
+    int16_t w[WEIGHT_ONE][4];
+
+    BicubicTable() {
+        for (int phase = 0; phase < WEIGHT_ONE; ++phase) {
+            double t = static_cast<double>(phase) / WEIGHT_ONE;
+            double d[4] = {1 + t, t, 1 - t, 2 - t};
+            int sum = 0;
+            for (int i = 0; i < 4; ++i) {
+                double x = d[i];
+                double k = x <= 1 ? (1.5 * x - 2.5) * x * x + 1
+                                  : ((-0.5 * x + 2.5) * x - 4) * x + 2;
+                w[phase][i] = static_cast<int16_t>(std::lround(k * WEIGHT_ONE));
+                sum += w[phase][i];
+            }
+            // keep flat areas exact
+            w[phase][1] += static_cast<int16_t>(WEIGHT_ONE - sum);
+        }
+    }
+};
+
+inline const BicubicTable& bicubic_table() {
+    static const BicubicTable table;
+    return table;
+}
+
+// Sums of weighted taps: 8-bit samples fit int, 16-bit ones need 64 bits
+template <typename T>
+using TapSum = std::conditional_t<sizeof(T) == 1, int, int64_t>;
+
+// Interpolating premultiplied pixels keeps colours of transparent neighbours
+// from bleeding into the result. image_data is RGBA; 16-bit stays 16-bit.
+inline Image premultiply_alpha(const Image& image_data) {
+    Image premultiplied(image_data.width, image_data.height, rgba_format(image_data.format.bit_depth));
+    with_sample_type(image_data.format, [&](auto sample) {
+        using T = decltype(sample);
+        using Wide = std::conditional_t<sizeof(T) == 1, unsigned, uint64_t>;
+        constexpr Wide max = std::numeric_limits<T>::max();
+        parallel_rows(image_data.height, image_data.width, 1, [&](int row_begin, int row_end) {
+            for (int y = row_begin; y < row_end; ++y) {
+                const T* s = reinterpret_cast<const T*>(image_data.row(y));
+                T* d = reinterpret_cast<T*>(premultiplied.row(y));
+                for (int x = 0; x < image_data.width; ++x, s += 4, d += 4) {
+                    Wide a = s[3];
+                    d[0] = static_cast<T>((s[0] * a + max / 2) / max);
+                    d[1] = static_cast<T>((s[1] * a + max / 2) / max);
+                    d[2] = static_cast<T>((s[2] * a + max / 2) / max);
+                    d[3] = static_cast<T>(a);
+                }
+            }
+        });
+    });
+    return premultiplied;
+}
+
+template <typename T>
+inline void unpremultiply_pixels(T* p, int n) {
+    using Wide = std::conditional_t<sizeof(T) == 1, unsigned, uint64_t>;
+    constexpr Wide max = std::numeric_limits<T>::max();
+    for (int x = 0; x < n; ++x, p += 4) {
+        Wide a = p[3];
+        if (a == max)
+            continue;
+        if (a == 0) {
+            p[0] = p[1] = p[2] = 0;
+            continue;
+        }
+        for (int c = 0; c < 3; ++c) {
+            p[c] = static_cast<T>(std::min(max, (p[c] * max + a / 2) / a));
+        }
+    }
+}
+
+// Source pixel for tap (x, y); outside the image everything is transparent.
+// Checked = false is only valid where the whole kernel footprint is inside.
+template <bool Checked, typename T>
+inline const T* tap(const Image& src, int x, int y) {
+    static const T transparent[4] = {0, 0, 0, 0};
+    if (Checked && (x < 0 || x >= src.width || y < 0 || y >= src.height))
+        return transparent;
+    return reinterpret_cast<const T*>(src.pixel(x, y));
+}
+
+// Sample the premultiplied source at fixed-point position (u, v), where pixel i
+// covers [i, i + 1) and its centre sits at i + 0.5.
+template <bool Checked, typename T>
+inline void sample_bilinear(const Image& src, int64_t u, int64_t v, T* out) {
+    int64_t pu = u - FIXED_ONE / 2;
+    int64_t pv = v - FIXED_ONE / 2;
+    int x = static_cast<int>(pu >> FIXED_SHIFT);
+    int y = static_cast<int>(pv >> FIXED_SHIFT);
+    int fx = static_cast<int>((pu >> (FIXED_SHIFT - WEIGHT_BITS)) & (WEIGHT_ONE - 1));
+    int fy = static_cast<int>((pv >> (FIXED_SHIFT - WEIGHT_BITS)) & (WEIGHT_ONE - 1));
+
+    const T* p00 = tap<Checked, T>(src, x, y);
+    const T* p10 = tap<Checked, T>(src, x + 1, y);
+    const T* p01 = tap<Checked, T>(src, x, y + 1);
+    const T* p11 = tap<Checked, T>(src, x + 1, y + 1);
+
+    TapSum<T> w00 = (WEIGHT_ONE - fx) * (WEIGHT_ONE - fy);
+    TapSum<T> w10 = fx * (WEIGHT_ONE - fy);
+    TapSum<T> w01 = (WEIGHT_ONE - fx) * fy;
+    TapSum<T> w11 = fx * fy;
+    for (int c = 0; c < 4; ++c) {
+        TapSum<T> sum = p00[c] * w00 + p10[c] * w10 + p01[c] * w01 + p11[c] * w11;
+        out[c] = static_cast<T>((sum + (1 << (2 * WEIGHT_BITS - 1))) >> (2 * WEIGHT_BITS));
+    }
+}
+
+template <bool Checked, typename T>
+inline void sample_bicubic(const Image& src, int64_t u, int64_t v, T* out) {
+    int64_t pu = u - FIXED_ONE / 2;
+    int64_t pv = v - FIXED_ONE / 2;
+    int x = static_cast<int>(pu >> FIXED_SHIFT);
+    int y = static_cast<int>(pv >> FIXED_SHIFT);
+    const int16_t* wx = bicubic_table().w[(pu >> (FIXED_SHIFT - WEIGHT_BITS)) & (WEIGHT_ONE - 1)];
+    const int16_t* wy = bicubic_table().w[(pv >> (FIXED_SHIFT - WEIGHT_BITS)) & (WEIGHT_ONE - 1)];
+
+    TapSum<T> sum[4] = {0, 0, 0, 0};
+    for (int j = 0; j < 4; ++j) {
+        TapSum<T> row[4] = {0, 0, 0, 0};
+        const T* line = Checked ? nullptr : tap<false, T>(src, x - 1, y - 1 + j);
+        for (int i = 0; i < 4; ++i) {
+            const T* p = Checked ? tap<true, T>(src, x - 1 + i, y - 1 + j) : line + i * 4;
+            for (int c = 0; c < 4; ++c) {
+                row[c] += p[c] * wx[i];
+            }
+        }
+        for (int c = 0; c < 4; ++c) {
+            sum[c] += row[c] * wy[j];
+        }
+    }
+
+    // the negative lobes can overshoot; premultiplied colour may not exceed alpha
+    constexpr TapSum<T> max = std::numeric_limits<T>::max();
+    TapSum<T> a = std::clamp<TapSum<T>>((sum[3] + (1 << (2 * WEIGHT_BITS - 1))) >> (2 * WEIGHT_BITS), 0, max);
+    for (int c = 0; c < 3; ++c) {
+        out[c] = static_cast<T>(std::clamp<TapSum<T>>((sum[c] + (1 << (2 * WEIGHT_BITS - 1))) >> (2 * WEIGHT_BITS), 0, a));
+    }
+    out[3] = static_cast<T>(a);
+}
+
+template <bool Checked, typename T>
+inline void sample_pixel(const Image& src, int64_t u, int64_t v, Interpolation interpolation, T* out) {
+    if (interpolation == Interpolation::bicubic) {
+        sample_bicubic<Checked>(src, u, v, out);
+    } else {
+        sample_bilinear<Checked>(src, u, v, out);
+    }
+}
+
+// interpolate n pixels along a row walk, still premultiplied
+template <bool Checked, typename T>
+inline void resample_run(const Image& src, T* dst, int64_t u, int64_t v, int64_t du, int64_t dv,
+                         int n, Interpolation interpolation) {
+    if (interpolation == Interpolation::bicubic) {
+        for (int x = 0; x < n; ++x, u += du, v += dv, dst += 4)
+            sample_bicubic<Checked>(src, u, v, dst);
+    } else {
+        for (int x = 0; x < n; ++x, u += du, v += dv, dst += 4)
+            sample_bilinear<Checked>(src, u, v, dst);
+    }
+}
+
+// Runs of 8-bit RGBA pixels whose taps are all inside the source are the bulk
+// of every interpolated rotation; they get SIMD kernels that keep the four
+// channels of a pixel in one vector (two pixels per vector with AVX2). The
+// integer sums are the scalar ones, so every level gives identical pixels.
+// 16-bit samples and the fringe with its bounds tests stay scalar.
+using ResampleKernel = void (*)(const Image& src, uint8_t* dst, int64_t u, int64_t v, int64_t du, int64_t dv, int n);
+
+template <Interpolation Kernel>
+inline void resample_inner_scalar(const Image& src, uint8_t* dst, int64_t u, int64_t v, int64_t du, int64_t dv,
+                                  int n) {
+    resample_run<false>(src, dst, u, v, du, dv, n, Kernel);
+}
+
+#ifdef ROTATE_X86
+
+// integer tap position and 8-bit phase of fixed-point coordinate u, as in
+// sample_bilinear and sample_bicubic
+inline int tap_origin(int64_t u, int& phase) {
+    int64_t p = u - FIXED_ONE / 2;
+    phase = static_cast<int>((p >> (FIXED_SHIFT - WEIGHT_BITS)) & (WEIGHT_ONE - 1));
+    return static_cast<int>(p >> FIXED_SHIFT);
+}
+
+// Bilinear: the horizontal pairs are summed with madd first,
+// h = p0 * (256 - fx) + p1 * fx, which is at most 65280 and so only fits
+// int16 once 32768 is taken off; the vertical madd then brings back
+// 32768 * 256. The result is exactly the scalar 2D sum.
+constexpr int32_t BILINEAR_BIAS = 32768;
+constexpr int32_t BILINEAR_OFFSET = BILINEAR_BIAS * WEIGHT_ONE + (1 << (2 * WEIGHT_BITS - 1));
+
+// two neighbouring pixels as (p0[c], p1[c]) 16-bit pairs, times (w0, w1)
+__attribute__((target("sse2")))
+inline __m128i madd_pixel_pair_sse2(__m128i pixels, __m128i weights) {
+    pixels = _mm_unpacklo_epi16(pixels, _mm_srli_si128(pixels, 8));
+    return _mm_madd_epi16(pixels, weights);
+}
+
+// pair of 16-bit weights (w0 low, w1 high) in every 32-bit lane
+inline int32_t weight_pair(int w0, int w1) {
+    return static_cast<int32_t>(static_cast<uint32_t>(static_cast<uint16_t>(w0)) |
+                                (static_cast<uint32_t>(static_cast<uint16_t>(w1)) << 16));
+}
+
+__attribute__((target("sse2")))
+inline void resample_bilinear_sse2(const Image& src, uint8_t* dst, int64_t u, int64_t v, int64_t du, int64_t dv,
+                                   int n) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias = _mm_set1_epi32(BILINEAR_BIAS);
+    const __m128i offset = _mm_set1_epi32(BILINEAR_OFFSET);
+    for (int i = 0; i < n; ++i, u += du, v += dv, dst += 4) {
+        int fx, fy;
+        int x = tap_origin(u, fx);
+        int y = tap_origin(v, fy);
+        __m128i wx = _mm_set1_epi32(weight_pair(WEIGHT_ONE - fx, fx));
+        __m128i wy = _mm_set1_epi32(weight_pair(WEIGHT_ONE - fy, fy));
+        __m128i top = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src.pixel(x, y))), zero);
+        __m128i bottom = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(src.pixel(x, y + 1))), zero);
+        __m128i h = _mm_packs_epi32(_mm_sub_epi32(madd_pixel_pair_sse2(top, wx), bias),
+                                    _mm_sub_epi32(madd_pixel_pair_sse2(bottom, wx), bias));
+        __m128i sum = _mm_add_epi32(madd_pixel_pair_sse2(h, wy), offset);
+        __m128i out = _mm_srai_epi32(sum, 2 * WEIGHT_BITS);
+        out = _mm_packs_epi32(out, out);
+        int32_t pixel = _mm_cvtsi128_si32(_mm_packus_epi16(out, out));
+        std::memcpy(dst, &pixel, 4);
+    }
+}
+
+// SSE2 has no 32-bit multiply keeping the low halves; two widening ones do it
+__attribute__((target("sse2")))
+inline __m128i mullo_epi32_sse2(__m128i a, __m128i b) {
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+// Round the 32-bit bicubic sums of one pixel (or one per 128-bit lane) and
+// clamp them as sample_bicubic does: alpha to [0, 255], colour to [0, alpha].
+// The rounded sums stay within int16.
+__attribute__((target("sse2")))
+inline __m128i bicubic_result_sse2(__m128i sum) {
+    __m128i out = _mm_srai_epi32(_mm_add_epi32(sum, _mm_set1_epi32(1 << (2 * WEIGHT_BITS - 1))), 2 * WEIGHT_BITS);
+    out = _mm_packs_epi32(out, out);
+    __m128i alpha = _mm_shufflelo_epi16(out, _MM_SHUFFLE(3, 3, 3, 3));
+    alpha = _mm_min_epi16(_mm_max_epi16(alpha, _mm_setzero_si128()), _mm_set1_epi16(255));
+    out = _mm_min_epi16(_mm_max_epi16(out, _mm_setzero_si128()), alpha);
+    return _mm_packus_epi16(out, out);
+}
+
+__attribute__((target("sse2")))
+inline void resample_bicubic_sse2(const Image& src, uint8_t* dst, int64_t u, int64_t v, int64_t du, int64_t dv,
+                                  int n) {
+    const BicubicTable& table = bicubic_table();
+    const __m128i zero = _mm_setzero_si128();
+    for (int i = 0; i < n; ++i, u += du, v += dv, dst += 4) {
+        int fx, fy;
+        int x = tap_origin(u, fx);
+        int y = tap_origin(v, fy);
+        const int16_t* wx = table.w[fx];
+        const int16_t* wy = table.w[fy];
+        __m128i wx01 = _mm_set1_epi32(weight_pair(wx[0], wx[1]));
+        __m128i wx23 = _mm_set1_epi32(weight_pair(wx[2], wx[3]));
+        __m128i sum = zero;
+        for (int j = 0; j < 4; ++j) {
+            __m128i line = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src.pixel(x - 1, y - 1 + j)));
+            __m128i row = _mm_add_epi32(madd_pixel_pair_sse2(_mm_unpacklo_epi8(line, zero), wx01),
+                                        madd_pixel_pair_sse2(_mm_unpackhi_epi8(line, zero), wx23));
+            sum = _mm_add_epi32(sum, mullo_epi32_sse2(row, _mm_set1_epi32(wy[j])));
+        }
+        int32_t pixel = _mm_cvtsi128_si32(bicubic_result_sse2(sum));
+        std::memcpy(dst, &pixel, 4);
+    }
+}
+
+// the AVX2 kernels take two pixels at a time, one per 128-bit lane, with the
+// same per-lane steps as SSE2
+__attribute__((target("avx2")))
+inline __m256i load_pixel_pair_avx2(const unsigned char* a, const unsigned char* b) {
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(a))),
+                                   _mm_loadl_epi64(reinterpret_cast<const __m128i*>(b)), 1);
+}
+
+__attribute__((target("avx2")))
+inline __m256i madd_pixel_pair_avx2(__m256i pixels, __m256i weights) {
+    pixels = _mm256_unpacklo_epi16(pixels, _mm256_srli_si256(pixels, 8));
+    return _mm256_madd_epi16(pixels, weights);
+}
+
+__attribute__((target("avx2")))
+inline void store_pixel_pair_avx2(uint8_t* dst, __m256i pixels) {
+    int32_t a = _mm_cvtsi128_si32(_mm256_castsi256_si128(pixels));
+    int32_t b = _mm_cvtsi128_si32(_mm256_extracti128_si256(pixels, 1));
+    std::memcpy(dst, &a, 4);
+    std::memcpy(dst + 4, &b, 4);
+}
+
+__attribute__((target("avx2")))
+inline void resample_bilinear_avx2(const Image& src, uint8_t* dst, int64_t u, int64_t v, int64_t du, int64_t dv,
+                                   int n) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i bias = _mm256_set1_epi32(BILINEAR_BIAS);
+    const __m256i offset = _mm256_set1_epi32(BILINEAR_OFFSET);
+    int i = 0;
+    for (; i + 2 <= n; i += 2, u += 2 * du, v += 2 * dv, dst += 8) {
+        int fxa, fya, fxb, fyb;
+        int xa = tap_origin(u, fxa);
+        int ya = tap_origin(v, fya);
+        int xb = tap_origin(u + du, fxb);
+        int yb = tap_origin(v + dv, fyb);
+        int32_t wxa = weight_pair(WEIGHT_ONE - fxa, fxa);
+        int32_t wxb = weight_pair(WEIGHT_ONE - fxb, fxb);
+        int32_t wya = weight_pair(WEIGHT_ONE - fya, fya);
+        int32_t wyb = weight_pair(WEIGHT_ONE - fyb, fyb);
+        __m256i wx = _mm256_setr_epi32(wxa, wxa, wxa, wxa, wxb, wxb, wxb, wxb);
+        __m256i wy = _mm256_setr_epi32(wya, wya, wya, wya, wyb, wyb, wyb, wyb);
+        __m256i top = _mm256_unpacklo_epi8(load_pixel_pair_avx2(src.pixel(xa, ya), src.pixel(xb, yb)), zero);
+        __m256i bottom = _mm256_unpacklo_epi8(load_pixel_pair_avx2(src.pixel(xa, ya + 1), src.pixel(xb, yb + 1)), zero);
+        __m256i h = _mm256_packs_epi32(_mm256_sub_epi32(madd_pixel_pair_avx2(top, wx), bias),
+                                       _mm256_sub_epi32(madd_pixel_pair_avx2(bottom, wx), bias));
+        __m256i sum = _mm256_add_epi32(madd_pixel_pair_avx2(h, wy), offset);
+        __m256i out = _mm256_srai_epi32(sum, 2 * WEIGHT_BITS);
+        out = _mm256_packs_epi32(out, out);
+        store_pixel_pair_avx2(dst, _mm256_packus_epi16(out, out));
+    }
+    resample_bilinear_sse2(src, dst, u, v, du, dv, n - i);
+}
+
+__attribute__((target("avx2")))
+inline void resample_bicubic_avx2(const Image& src, uint8_t* dst, int64_t u, int64_t v, int64_t du, int64_t dv,
+                                  int n) {
+    const BicubicTable& table = bicubic_table();
+    const __m256i zero = _mm256_setzero_si256();
+    int i = 0;
+    for (; i + 2 <= n; i += 2, u += 2 * du, v += 2 * dv, dst += 8) {
+        int fxa, fya, fxb, fyb;
+        int xa = tap_origin(u, fxa);
+        int ya = tap_origin(v, fya);
+        int xb = tap_origin(u + du, fxb);
+        int yb = tap_origin(v + dv, fyb);
+        const int16_t* wxa = table.w[fxa];
+        const int16_t* wxb = table.w[fxb];
+        const int16_t* wya = table.w[fya];
+        const int16_t* wyb = table.w[fyb];
+        int32_t a01 = weight_pair(wxa[0], wxa[1]);
+        int32_t a23 = weight_pair(wxa[2], wxa[3]);
+        int32_t b01 = weight_pair(wxb[0], wxb[1]);
+        int32_t b23 = weight_pair(wxb[2], wxb[3]);
+        __m256i wx01 = _mm256_setr_epi32(a01, a01, a01, a01, b01, b01, b01, b01);
+        __m256i wx23 = _mm256_setr_epi32(a23, a23, a23, a23, b23, b23, b23, b23);
+        __m256i sum = zero;
+        for (int j = 0; j < 4; ++j) {
+            __m256i line = _mm256_inserti128_si256(
+                _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src.pixel(xa - 1, ya - 1 + j)))),
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(src.pixel(xb - 1, yb - 1 + j))), 1);
+            __m256i row = _mm256_add_epi32(madd_pixel_pair_avx2(_mm256_unpacklo_epi8(line, zero), wx01),
+                                           madd_pixel_pair_avx2(_mm256_unpackhi_epi8(line, zero), wx23));
+            __m256i wy = _mm256_setr_epi32(wya[j], wya[j], wya[j], wya[j], wyb[j], wyb[j], wyb[j], wyb[j]);
+            sum = _mm256_add_epi32(sum, _mm256_mullo_epi32(row, wy));
+        }
+        __m256i out = _mm256_srai_epi32(_mm256_add_epi32(sum, _mm256_set1_epi32(1 << (2 * WEIGHT_BITS - 1))),
+                                        2 * WEIGHT_BITS);
+        out = _mm256_packs_epi32(out, out);
+        __m256i alpha = _mm256_shufflelo_epi16(out, _MM_SHUFFLE(3, 3, 3, 3));
+        alpha = _mm256_min_epi16(_mm256_max_epi16(alpha, zero), _mm256_set1_epi16(255));
+        out = _mm256_min_epi16(_mm256_max_epi16(out, zero), alpha);
+        store_pixel_pair_avx2(dst, _mm256_packus_epi16(out, out));
+    }
+    resample_bicubic_sse2(src, dst, u, v, du, dv, n - i);
+}
+
+#endif  // ROTATE_X86
+
+// AVX-512 hosts take the AVX2 kernels, two pixels per step are all a gather-free
+// tap fetch can feed
+inline ResampleKernel resample_kernel(Interpolation interpolation, SimdLevel level) {
+    bool bicubic = interpolation == Interpolation::bicubic;
+    switch (level) {
+#ifdef ROTATE_X86
+    case SimdLevel::avx512:
+    case SimdLevel::avx2: return bicubic ? resample_bicubic_avx2 : resample_bilinear_avx2;
+    case SimdLevel::sse2: return bicubic ? resample_bicubic_sse2 : resample_bilinear_sse2;
+#endif
+    default: return bicubic ? resample_inner_scalar<Interpolation::bicubic> : resample_inner_scalar<Interpolation::bilinear>;
+    }
+}
+
+inline ResampleKernel select_resample_kernel(Interpolation interpolation) {
+    return resample_kernel(interpolation, active_simd_level);
+}
@@ -0,0 +1,293 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "image.h"
+#include "parallel.h"
+#include "pixel_format.h"
+#include "resample.h"
+#include "span_kernels.h"
+
+// output size and centers for rotating a width x height image by an arbitrary angle,
+// laid out exactly like rotate_image_reference
+struct RotationGeometry {
+    int width = 0;
+    int height = 0;
+    int new_width = 0;
+    int new_height = 0;
+    int cx = 0;
+    int cy = 0;
+    int new_cx = 0;
+    int new_cy = 0;
+    double cos_theta = 1.0;
+    double sin_theta = 0.0;
+};
+
+inline RotationGeometry rotation_geometry(int width, int height, double angle_degrees) {
+    RotationGeometry g;
+    double angle_rad = angle_degrees * M_PI / 180.0;
+    g.cos_theta = cos(angle_rad);
+    g.sin_theta = sin(angle_rad);
+
+    g.width = width;
+    g.height = height;
+    g.cx = width / 2;
+    g.cy = height / 2;
+
+    g.new_width = static_cast<int>(std::abs(width * g.cos_theta) + std::abs(height * g.sin_theta));
+    g.new_height = static_cast<int>(std::abs(width * g.sin_theta) + std::abs(height * g.cos_theta));
+    g.new_cx = g.new_width / 2;
+    g.new_cy = g.new_height / 2;
+    return g;
+}
+
+inline int64_t to_fixed(double v) {
+    return static_cast<int64_t>(std::llround(v * FIXED_ONE));
+}
+
+inline int64_t floor_div(int64_t a, int64_t b) {
+    int64_t q = a / b;
+    return (a % b != 0 && ((a < 0) != (b < 0))) ? q - 1 : q;
+}
+
+inline int64_t ceil_div(int64_t a, int64_t b) {
+    int64_t q = a / b;
+    return (a % b != 0 && ((a < 0) == (b < 0))) ? q + 1 : q;
+}
+
+// narrow [x0, x1) to the x for which min <= start + x * step <= max
+inline void clip_span(int64_t start, int64_t step, int64_t min, int64_t max, int& x0, int& x1) {
+    int64_t lo = x0;
+    int64_t hi = x1;
+    if (step == 0) {
+        if (start < min || start > max)
+            hi = lo;
+    } else if (step > 0) {
+        lo = std::max(lo, ceil_div(min - start, step));
+        hi = std::min(hi, floor_div(max - start, step) + 1);
+    } else {
+        lo = std::max(lo, ceil_div(max - start, step));
+        hi = std::min(hi, floor_div(min - start, step) + 1);
+    }
+    x0 = static_cast<int>(lo);
+    x1 = static_cast<int>(std::max(lo, hi));
+}
+
+inline FixedMapping fixed_mapping(const RotationGeometry& g) {
+    FixedMapping m;
+    m.du = to_fixed(g.cos_theta);
+    m.dv = to_fixed(-g.sin_theta);
+    return m;
+}
+
+// fixed-point source coordinates a row span may reach, inclusive
+struct SourceWindow {
+    int64_t u_min = 0;
+    int64_t u_max = 0;
+    int64_t v_min = 0;
+    int64_t v_max = 0;
+};
+
+// Nearest neighbour reads pixel floor(u). The interpolating kernels read
+// radius taps on either side of u - 0.5; `inner` keeps all of them inside
+// the source, otherwise at least one has to be.
+inline SourceWindow source_window(const RotationGeometry& g, Interpolation interpolation, bool inner) {
+    SourceWindow w;
+    if (interpolation == Interpolation::nearest) {
+        w.u_max = g.width * FIXED_ONE - 1;
+        w.v_max = g.height * FIXED_ONE - 1;
+        return w;
+    }
+    int64_t r = interpolation_radius(interpolation);
+    int64_t half = FIXED_ONE / 2;
+    int64_t lo = inner ? r - 1 : -r;
+    int64_t hi = inner ? -r : r - 1;
+    w.u_min = lo * FIXED_ONE + half;
+    w.u_max = (g.width + hi) * FIXED_ONE + half - 1;
+    w.v_min = lo * FIXED_ONE + half;
+    w.v_max = (g.height + hi) * FIXED_ONE + half - 1;
+    return w;
+}
+
+// Where in output pixel (x, y) the mapping is evaluated. Nearest neighbour
+// maps its corner, as rotate_image_reference does; the interpolating kernels
+// centre source pixel i at i + 0.5, so they map the output pixel's centre and
+// a rotation by 0 degrees reproduces the source.
+inline double sample_offset(Interpolation interpolation) {
+    return interpolation == Interpolation::nearest ? 0.0 : 0.5;
+}
+
+inline RowSpan row_span(const RotationGeometry& g, const FixedMapping& m, int y, const SourceWindow& w,
+                        double offset) {
+    RowSpan span;
+    double xt = offset - g.new_cx;
+    double yt = y + offset - g.new_cy;
+    span.u0 = to_fixed(g.cos_theta * xt + g.sin_theta * yt + g.cx);
+    span.v0 = to_fixed(-g.sin_theta * xt + g.cos_theta * yt + g.cy);
+
+    span.x0 = 0;
+    span.x1 = g.new_width;
+    clip_span(span.u0, m.du, w.u_min, w.u_max, span.x0, span.x1);
+    clip_span(span.v0, m.dv, w.v_min, w.v_max, span.x0, span.x1);
+    if (span.x1 <= span.x0)
+        span.x0 = span.x1 = 0;
+    return span;
+}
+
+// Interpolated span: pixels in [inner.x0, inner.x1) have every tap inside the
+// source and skip the bounds tests (8-bit ones on the SIMD kernel), the fringe
+// up to the outer span fades into transparency.
+template <typename T>
+inline void resample_span(const Image& premultiplied, T* row, const RowSpan& outer, const RowSpan& inner,
+                          const FixedMapping& m, Interpolation interpolation, ResampleKernel resample_inner) {
+    int ix0 = std::clamp(inner.x0, outer.x0, outer.x1);
+    int ix1 = std::clamp(inner.x1, ix0, outer.x1);
+    if (inner.x1 <= inner.x0)
+        ix0 = ix1 = outer.x1;
+
+    auto at = [&](int x) { return row + static_cast<size_t>(x) * 4; };
+    resample_run<true>(premultiplied, at(outer.x0), outer.u0 + outer.x0 * m.du, outer.v0 + outer.x0 * m.dv,
+                       m.du, m.dv, ix0 - outer.x0, interpolation);
+    if constexpr (sizeof(T) == 1) {
+        resample_inner(premultiplied, at(ix0), outer.u0 + ix0 * m.du, outer.v0 + ix0 * m.dv, m.du, m.dv, ix1 - ix0);
+    } else {
+        resample_run<false>(premultiplied, at(ix0), outer.u0 + ix0 * m.du, outer.v0 + ix0 * m.dv,
+                            m.du, m.dv, ix1 - ix0, interpolation);
+    }
+    resample_run<true>(premultiplied, at(ix1), outer.u0 + ix1 * m.du, outer.v0 + ix1 * m.dv,
+                       m.du, m.dv, outer.x1 - ix1, interpolation);
+    unpremultiply_pixels(at(outer.x0), outer.x1 - outer.x0);
+}
+
+// Arbitrary-angle rotation that steps the source coordinates incrementally in
+// fixed point. Each output row is clipped analytically to the span that maps
+// inside the source, so the inner loop has no bounds test and the transparent
+// corners are filled with memset. Nearest-neighbour spans are copied by the
+// widest SIMD kernel the CPU supports (see span_kernels.h) and keep the
+// source's pixel format; bilinear and bicubic interpolate premultiplied RGBA
+// (8- or 16-bit) with fixed-point weights, 8-bit on SIMD kernels too (see
+// resample.h).
+inline Image rotate_image_fixed(const Image& image_data, double angle_degrees,
+                                Interpolation interpolation = Interpolation::nearest) {
+    RotationGeometry g = rotation_geometry(image_data.width, image_data.height, angle_degrees);
+    FixedMapping m = fixed_mapping(g);
+    SourceWindow outer_window = source_window(g, interpolation, false);
+    SourceWindow inner_window = source_window(g, interpolation, true);
+    double offset = sample_offset(interpolation);
+
+    Image converted;
+    Image premultiplied;
+    if (interpolation != Interpolation::nearest)
+        premultiplied = premultiply_alpha(rgba_source(image_data, converted));
+    const Image& source = interpolation != Interpolation::nearest ? premultiplied
+                                                                  : with_transparency(image_data, converted);
+    SpanKernel rotate_span = select_span_kernel(source);
+    ResampleKernel resample_inner = select_resample_kernel(interpolation);
+    int bytes = source.pixel_bytes;
+    unsigned char fill = source.format.fill;
+
+    Image rotated_image(g.new_width, g.new_height, source.format);
+    parallel_rows(g.new_height, g.new_width, 1, [&](int row_begin, int row_end) {
+        for (int y = row_begin; y < row_end; ++y) {
+            unsigned char* row = rotated_image.row(y);
+            RowSpan span = row_span(g, m, y, outer_window, offset);
+
+            std::memset(row, fill, static_cast<size_t>(span.x0) * bytes);
+            if (interpolation == Interpolation::nearest) {
+                rotate_span(source, row, span, m);
+            } else {
+                RowSpan inner = row_span(g, m, y, inner_window, offset);
+                with_sample_type(source.format, [&](auto sample) {
+                    using T = decltype(sample);
+                    resample_span(premultiplied, reinterpret_cast<T*>(row), span, inner, m, interpolation,
+                                  resample_inner);
+                });
+            }
+            std::memset(row + static_cast<size_t>(span.x1) * bytes, fill,
+                        static_cast<size_t>(g.new_width - span.x1) * bytes);
+        }
+    });
+    return rotated_image;
+}
+
+// The original per-pixel rotation of v3.cpp: every output pixel is mapped back
+// in double precision and bounds-checked (--engine=reference).
+inline Image rotate_image_reference(const Image& source_image, double angle_degrees) {
+    Image converted;
+    const Image& image_data = with_transparency(source_image, converted);
+    int width = image_data.width;
+    int height = image_data.height;
+
+    double angle_rad = angle_degrees * M_PI / 180.0;
+    double cos_theta = cos(angle_rad);
+    double sin_theta = sin(angle_rad);
+
+    int cx = width / 2;
+    int cy = height / 2;
+
+    int new_width = static_cast<int>(std::abs(width * cos_theta) + std::abs(height * sin_theta));
+    int new_height = static_cast<int>(std::abs(width * sin_theta) + std::abs(height * cos_theta));
+
+    Image rotated_image(new_width, new_height, image_data.format);
+    rotated_image.clear();
+
+    int new_cx = new_width / 2;
+    int new_cy = new_height / 2;
+
+    // large images are split into row bands when the pool has idle threads
+    with_pixel_bytes(image_data.pixel_bytes, [&](auto bytes) {
+        constexpr int Bytes = decltype(bytes)::value;
+        parallel_rows(new_height, new_width, 1, [&](int row_begin, int row_end) {
+            for (int y = row_begin; y < row_end; ++y) {
+                for (int x = 0; x < new_width; ++x) {
+                    double xt = x - new_cx;
+                    double yt = y - new_cy;
+
+                    int orig_x = static_cast<int>(cos_theta * xt + sin_theta * yt + cx);
+                    int orig_y = static_cast<int>(-sin_theta * xt + cos_theta * yt + cy);
+
+                    if (orig_x >= 0 && orig_x < width && orig_y >= 0 && orig_y < height) {
+                        copy_pixel<Bytes>(rotated_image.pixel(x, y), image_data.pixel(orig_x, orig_y));
+                    }
+                }
+            }
+        });
+    });
+
+    return rotated_image;
+}
+
+// rotation engines selectable for arbitrary angles
+enum class RotationEngine {
+    reference,  // rotate_image_reference, per-pixel double-precision inverse mapping
+    fixed,      // rotate_image_fixed
+    shear,      // rotate_image_shear (shear.h)
+};
+
+inline const char* rotation_engine_name(RotationEngine engine) {
+    switch (engine) {
+    case RotationEngine::reference:
+        return "reference";
+    case RotationEngine::shear:
+        return "shear";
+    default:
+        return "fixed";
+    }
+}
+
+inline bool parse_rotation_engine(const std::string& name, RotationEngine& engine) {
+    if (name == "reference") {
+        engine = RotationEngine::reference;
+    } else if (name == "fixed") {
+        engine = RotationEngine::fixed;
+    } else if (name == "shear") {
+        engine = RotationEngine::shear;
+    } else {
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "image.h"
+#include "parallel.h"
+#include "pixel_format.h"
+#include "rotate.h"
+#include "transpose.h"
+
+// Rows [row_begin, row_end) of a horizontal shear: the source centred on
+// (src_cx, src_cy) is sheared by x' = x + shear * y and drawn into dst centred on
+// (dst_cx, dst_cy). Every row is one shifted memcpy plus the cleared margins;
+// both images have the same pixel format.
+inline void shear_rows(const Image& src, int src_cx, int src_cy,
+                       Image& dst, int dst_cx, int dst_cy, double shear,
+                       int row_begin, int row_end) {
+    size_t bytes = src.pixel_bytes;
+    unsigned char fill = src.format.fill;
+    for (int dy = row_begin; dy < row_end; ++dy) {
+        unsigned char* row = dst.row(dy);
+        int sy = dy - dst_cy + src_cy;
+        if (sy < 0 || sy >= src.height) {
+            std::memset(row, fill, static_cast<size_t>(dst.width) * bytes);
+            continue;
+        }
+
+        // source pixel x lands on x + shift
+        int shift = dst_cx - src_cx + static_cast<int>(std::lround(shear * (dy - dst_cy)));
+        int x0 = std::clamp(shift, 0, dst.width);
+        int x1 = std::clamp(shift + src.width, x0, dst.width);
+
+        std::memset(row, fill, static_cast<size_t>(x0) * bytes);
+        std::memcpy(row + static_cast<size_t>(x0) * bytes, src.row(sy) + static_cast<size_t>(x0 - shift) * bytes,
+                    static_cast<size_t>(x1 - x0) * bytes);
+        std::memset(row + static_cast<size_t>(x1) * bytes, fill, static_cast<size_t>(dst.width - x1) * bytes);
+    }
+}
+
+inline Image transposed(const Image& image_data) {
+    return orient_image(image_data, Orientation::transpose);
+}
+
+// Arbitrary-angle rotation as three shears (Paeth): R = Sx(-tan(a/2)) Sy(sin a) Sx(-tan(a/2)).
+// Whole multiples of 90 degrees are taken out first with the lossless engine so the
+// remaining angle is within +-45 degrees. The vertical shear runs as a row shear
+// between two blocked transposes, so every pass streams whole rows. The output has
+// the same size and centre as rotate_image_fixed; samples are nearest-neighbour,
+// so every pass keeps the pixel format.
+inline Image rotate_image_shear(const Image& source_image, double angle_degrees) {
+    Image converted;
+    const Image& image_data = with_transparency(source_image, converted);
+    RotationGeometry g = rotation_geometry(image_data.width, image_data.height, angle_degrees);
+
+    int quarter_turns = static_cast<int>(std::lround(angle_degrees / 90.0));
+    double residual = (angle_degrees - quarter_turns * 90.0) * M_PI / 180.0;
+    quarter_turns = ((quarter_turns % 4) + 4) % 4;
+
+    Image turned;
+    if (quarter_turns != 0) {
+        static const Orientation turns[] = {Orientation::rotate_90, Orientation::rotate_180, Orientation::rotate_270};
+        turned = orient_image(image_data, turns[quarter_turns - 1]);
+    }
+    const Image& src = quarter_turns != 0 ? turned : image_data;
+
+    double a = -std::tan(residual / 2);
+    double b = std::sin(residual);
+    int cx = src.width / 2;
+    int cy = src.height / 2;
+
+    // first horizontal shear, height unchanged
+    Image first(src.width + static_cast<int>(std::ceil(std::abs(a) * src.height)) + 2, src.height, src.format);
+    int first_cx = first.width / 2;
+    parallel_rows(first.height, first.width, 1, [&](int row_begin, int row_end) {
+        shear_rows(src, cx, cy, first, first_cx, cy, a, row_begin, row_end);
+    });
+
+    // vertical shear on the transposed image, where it is a horizontal one
+    Image first_t = transposed(first);
+    Image second_t(first.height + static_cast<int>(std::ceil(std::abs(b) * first.width)) + 2, first.width, src.format);
+    int second_cy = second_t.width / 2;
+    parallel_rows(second_t.height, second_t.width, 1, [&](int row_begin, int row_end) {
+        shear_rows(first_t, cy, first_cx, second_t, second_cy, first_cx, b, row_begin, row_end);
+    });
+    Image second = transposed(second_t);
+
+    // last horizontal shear straight into the output frame
+    Image rotated_image(g.new_width, g.new_height, src.format);
+    parallel_rows(rotated_image.height, rotated_image.width, 1, [&](int row_begin, int row_end) {
+        shear_rows(second, first_cx, second_cy, rotated_image, g.new_cx, g.new_cy, a, row_begin, row_end);
+    });
+    return rotated_image;
+}
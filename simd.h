@@ -0,0 +1,64 @@
+#pragma once
+
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ROTATE_X86 1
+#endif
+
+// Vector kernels are compiled with target attributes and chosen at runtime,
+// so one binary runs on every host without -m flags.
+enum class SimdLevel {
+    scalar,
+    sse2,
+    avx2,
+    avx512,
+};
+
+inline SimdLevel detect_simd_level() {
+#ifdef ROTATE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return SimdLevel::avx512;
+    if (__builtin_cpu_supports("avx2"))
+        return SimdLevel::avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return SimdLevel::sse2;
+#endif
+    return SimdLevel::scalar;
+}
+
+inline const char* simd_level_name(SimdLevel level) {
+    switch (level) {
+    case SimdLevel::sse2:
+        return "sse2";
+    case SimdLevel::avx2:
+        return "avx2";
+    case SimdLevel::avx512:
+        return "avx512";
+    default:
+        return "scalar";
+    }
+}
+
+inline bool parse_simd_level(const std::string& name, SimdLevel& level) {
+    if (name == "auto") {
+        level = detect_simd_level();
+    } else if (name == "scalar") {
+        level = SimdLevel::scalar;
+    } else if (name == "sse2") {
+        level = SimdLevel::sse2;
+    } else if (name == "avx2") {
+        level = SimdLevel::avx2;
+    } else if (name == "avx512") {
+        level = SimdLevel::avx512;
+    } else {
+        return false;
+    }
+    // never hand out a kernel the CPU cannot run
+    return level <= detect_simd_level();
+}
+
+// level used by all dispatched kernels, picked once from CPUID
+inline SimdLevel active_simd_level = detect_simd_level();
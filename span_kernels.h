@@ -0,0 +1,169 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include "image.h"
+#include "simd.h"
+
+// source coordinates are walked in 16.16 fixed point
+constexpr int FIXED_SHIFT = 16;
+constexpr int64_t FIXED_ONE = int64_t(1) << FIXED_SHIFT;
+
+// Per-row walk of the inverse mapping: output pixel (x, y) samples the source at
+// (u0 + x * du, v0 + x * dv) in fixed point, and only x in [x0, x1) lands inside.
+struct RowSpan {
+    int x0 = 0;
+    int x1 = 0;
+    int64_t u0 = 0;
+    int64_t v0 = 0;
+};
+
+struct FixedMapping {
+    int64_t du = 0;  // source step per output pixel along a row
+    int64_t dv = 0;
+};
+
+// copies the pixels of one clipped span into dst_row, nearest neighbour
+using SpanKernel = void (*)(const Image& src, unsigned char* dst_row, const RowSpan& span, const FixedMapping& m);
+
+// source coordinates floor to pixels; instantiated for every pixel size
+template <int Bytes>
+inline void rotate_span_scalar(const Image& src, unsigned char* dst_row, const RowSpan& span, const FixedMapping& m) {
+    int64_t u = span.u0 + span.x0 * m.du;
+    int64_t v = span.v0 + span.x0 * m.dv;
+    for (int x = span.x0; x < span.x1; ++x) {
+        copy_pixel<Bytes>(dst_row + x * Bytes, src.pixel(static_cast<int>(u >> FIXED_SHIFT), static_cast<int>(v >> FIXED_SHIFT)));
+        u += m.du;
+        v += m.dv;
+    }
+}
+
+// The vector kernels move 32-bit pixels and keep coordinates and pixel offsets
+// in 32-bit lanes. Inside a span the coordinates are exact integers in
+// [0, size << 16), so they produce the same pixels as the scalar walk whenever
+// these bounds hold.
+inline bool span_fits_32bit(const Image& src) {
+    return src.width < (1 << (31 - FIXED_SHIFT)) && src.height < (1 << (31 - FIXED_SHIFT)) &&
+           src.stride / RGBA_PIXEL_BYTES * static_cast<size_t>(src.height) < (size_t(1) << 31);
+}
+
+#ifdef ROTATE_X86
+
+// 4 coordinates at a time; SSE2 has no gather, so pixels are fetched one by one
+__attribute__((target("sse2")))
+inline void rotate_span_sse2(const Image& src, unsigned char* dst_row, const RowSpan& span, const FixedMapping& m) {
+    int x = span.x0;
+    int32_t u = static_cast<int32_t>(span.u0 + x * m.du);
+    int32_t v = static_cast<int32_t>(span.v0 + x * m.dv);
+    int32_t du = static_cast<int32_t>(m.du);
+    int32_t dv = static_cast<int32_t>(m.dv);
+
+    const unsigned char* base = src.data();
+    __m128i uu = _mm_setr_epi32(u, u + du, u + 2 * du, u + 3 * du);
+    __m128i vv = _mm_setr_epi32(v, v + dv, v + 2 * dv, v + 3 * dv);
+    __m128i step_u = _mm_set1_epi32(4 * du);
+    __m128i step_v = _mm_set1_epi32(4 * dv);
+
+    alignas(16) int32_t px[4];
+    alignas(16) int32_t py[4];
+    for (; x + 4 <= span.x1; x += 4) {
+        _mm_store_si128(reinterpret_cast<__m128i*>(px), _mm_srai_epi32(uu, FIXED_SHIFT));
+        _mm_store_si128(reinterpret_cast<__m128i*>(py), _mm_srai_epi32(vv, FIXED_SHIFT));
+        int32_t p[4];
+        for (int i = 0; i < 4; ++i) {
+            std::memcpy(&p[i], base + py[i] * src.stride + px[i] * 4, 4);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst_row + x * 4),
+                         _mm_setr_epi32(p[0], p[1], p[2], p[3]));
+        uu = _mm_add_epi32(uu, step_u);
+        vv = _mm_add_epi32(vv, step_v);
+    }
+
+    RowSpan tail = span;
+    tail.x0 = x;
+    rotate_span_scalar<4>(src, dst_row, tail, m);
+}
+
+// 8 coordinates at a time with a 32-bit gather
+__attribute__((target("avx2")))
+inline void rotate_span_avx2(const Image& src, unsigned char* dst_row, const RowSpan& span, const FixedMapping& m) {
+    int x = span.x0;
+    int32_t u = static_cast<int32_t>(span.u0 + x * m.du);
+    int32_t v = static_cast<int32_t>(span.v0 + x * m.dv);
+
+    const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i uu = _mm256_add_epi32(_mm256_set1_epi32(u), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(static_cast<int32_t>(m.du))));
+    __m256i vv = _mm256_add_epi32(_mm256_set1_epi32(v), _mm256_mullo_epi32(lanes, _mm256_set1_epi32(static_cast<int32_t>(m.dv))));
+    __m256i step_u = _mm256_set1_epi32(static_cast<int32_t>(8 * m.du));
+    __m256i step_v = _mm256_set1_epi32(static_cast<int32_t>(8 * m.dv));
+    __m256i row_pixels = _mm256_set1_epi32(static_cast<int32_t>(src.stride / 4));
+    const int* base = reinterpret_cast<const int*>(src.data());
+
+    for (; x + 8 <= span.x1; x += 8) {
+        __m256i index = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_srai_epi32(vv, FIXED_SHIFT), row_pixels),
+                                         _mm256_srai_epi32(uu, FIXED_SHIFT));
+        __m256i pixels = _mm256_i32gather_epi32(base, index, 4);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst_row + x * 4), pixels);
+        uu = _mm256_add_epi32(uu, step_u);
+        vv = _mm256_add_epi32(vv, step_v);
+    }
+
+    RowSpan tail = span;
+    tail.x0 = x;
+    rotate_span_scalar<4>(src, dst_row, tail, m);
+}
+
+// 16 coordinates at a time; the ragged end of the span uses a masked gather.
+// GCC 12 reports a false maybe-uninitialized inside its own AVX-512 headers.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+__attribute__((target("avx512f")))
+inline void rotate_span_avx512(const Image& src, unsigned char* dst_row, const RowSpan& span, const FixedMapping& m) {
+    int x = span.x0;
+    int32_t u = static_cast<int32_t>(span.u0 + x * m.du);
+    int32_t v = static_cast<int32_t>(span.v0 + x * m.dv);
+
+    const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m512i uu = _mm512_add_epi32(_mm512_set1_epi32(u), _mm512_mullo_epi32(lanes, _mm512_set1_epi32(static_cast<int32_t>(m.du))));
+    __m512i vv = _mm512_add_epi32(_mm512_set1_epi32(v), _mm512_mullo_epi32(lanes, _mm512_set1_epi32(static_cast<int32_t>(m.dv))));
+    __m512i step_u = _mm512_set1_epi32(static_cast<int32_t>(16 * m.du));
+    __m512i step_v = _mm512_set1_epi32(static_cast<int32_t>(16 * m.dv));
+    __m512i row_pixels = _mm512_set1_epi32(static_cast<int32_t>(src.stride / 4));
+    const void* base = src.data();
+
+    for (; x < span.x1; x += 16) {
+        int remaining = span.x1 - x;
+        __mmask16 mask = remaining >= 16 ? __mmask16(0xFFFF) : __mmask16((1u << remaining) - 1);
+        __m512i index = _mm512_add_epi32(_mm512_mullo_epi32(_mm512_srai_epi32(vv, FIXED_SHIFT), row_pixels),
+                                         _mm512_srai_epi32(uu, FIXED_SHIFT));
+        __m512i pixels = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), mask, index, base, 4);
+        _mm512_mask_storeu_epi32(dst_row + x * 4, mask, pixels);
+        uu = _mm512_add_epi32(uu, step_u);
+        vv = _mm512_add_epi32(vv, step_v);
+    }
+}
+#pragma GCC diagnostic pop
+
+#endif  // ROTATE_X86
+
+inline SpanKernel span_kernel(SimdLevel level) {
+    switch (level) {
+#ifdef ROTATE_X86
+    case SimdLevel::avx512: return rotate_span_avx512;
+    case SimdLevel::avx2: return rotate_span_avx2;
+    case SimdLevel::sse2: return rotate_span_sse2;
+#endif
+    default: return rotate_span_scalar<4>;
+    }
+}
+
+// pixels of other sizes than 4 bytes always take the scalar walk
+inline SpanKernel select_span_kernel(const Image& src) {
+    if (src.pixel_bytes != 4) {
+        return with_pixel_bytes(src.pixel_bytes, [](auto bytes) -> SpanKernel {
+            return rotate_span_scalar<decltype(bytes)::value>;
+        });
+    }
+    return span_fits_32bit(src) ? span_kernel(active_simd_level) : rotate_span_scalar<4>;
+}
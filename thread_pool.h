@@ -0,0 +1,190 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool. Every worker owns a deque: it takes its own work
+// from the back (newest first, which keeps nested work cache-warm) and, when
+// that runs dry, steals from the front of the other deques (oldest first).
+class ThreadPool {
+public:
+    using Task = std::function<void()>;
+
+    explicit ThreadPool(int thread_count) {
+        if (thread_count < 1)
+            thread_count = 1;
+        for (int i = 0; i < thread_count; ++i) {
+            workers.push_back(std::make_unique<Worker>());
+        }
+        for (int i = 0; i < thread_count; ++i) {
+            threads.emplace_back([this, i]() { run(i); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& t : threads) {
+            if (t.joinable()) {
+                t.join();
+            }
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const { return static_cast<int>(workers.size()); }
+
+    // tasks queued but not yet started
+    size_t queued() const { return queued_count.load(std::memory_order_relaxed); }
+
+    // Queue a task. From inside a worker it goes to that worker's own deque,
+    // otherwise the deques are filled round-robin.
+    void submit(Task task) {
+        int target = current_worker;
+        if (current_pool != this) {
+            target = static_cast<int>(next_worker.fetch_add(1, std::memory_order_relaxed) % workers.size());
+        }
+        submit_to(target, std::move(task));
+    }
+
+    // queue a task on a specific worker, to be run next by that worker
+    void submit_to(int worker, Task task) {
+        push(worker, std::move(task), false);
+    }
+
+    // queue a task on a specific worker, behind everything already queued there
+    void submit_deferred(int worker, Task task) {
+        push(worker, std::move(task), true);
+    }
+
+    // block until every submitted task has finished
+    void wait_idle() {
+        std::unique_lock<std::mutex> lock(sleep_mutex);
+        idle.wait(lock, [this]() { return unfinished.load(std::memory_order_acquire) == 0; });
+    }
+
+    // Run one queued task on the calling thread if there is any. Lets a
+    // worker that waits on its own subtasks help instead of blocking.
+    bool run_pending_task() {
+        int self = current_pool == this ? current_worker : 0;
+        Task task;
+        if (!take(self, task))
+            return false;
+        execute(task);
+        return true;
+    }
+
+    // pool and worker index of the calling thread, if it is a pool worker
+    static ThreadPool* current() { return current_pool; }
+    static int current_index() { return current_worker; }
+
+private:
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    void push(int worker, Task task, bool deferred) {
+        unfinished.fetch_add(1, std::memory_order_relaxed);
+        // counted before it can be taken, so take's decrement never runs
+        // ahead of it; a take that sees the count first just finds nothing
+        queued_count.fetch_add(1, std::memory_order_release);
+        {
+            std::lock_guard<std::mutex> lock(workers[worker]->mutex);
+            if (deferred) {
+                workers[worker]->tasks.push_front(std::move(task));
+            } else {
+                workers[worker]->tasks.push_back(std::move(task));
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+        }
+        wake.notify_one();
+    }
+
+    bool pop_own(int self, Task& task) {
+        Worker& w = *workers[self];
+        std::lock_guard<std::mutex> lock(w.mutex);
+        if (w.tasks.empty())
+            return false;
+        task = std::move(w.tasks.back());
+        w.tasks.pop_back();
+        return true;
+    }
+
+    bool steal(int self, Task& task) {
+        size_t n = workers.size();
+        for (size_t k = 1; k < n; ++k) {
+            Worker& victim = *workers[(self + k) % n];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool take(int self, Task& task) {
+        if (queued_count.load(std::memory_order_acquire) == 0)
+            return false;
+        if (pop_own(self, task) || steal(self, task)) {
+            queued_count.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+        return false;
+    }
+
+    void execute(Task& task) {
+        task();
+        task = nullptr;
+        if (unfinished.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            idle.notify_all();
+        }
+    }
+
+    void run(int self) {
+        current_pool = this;
+        current_worker = self;
+        Task task;
+        while (true) {
+            if (take(self, task)) {
+                execute(task);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            wake.wait(lock, [this]() { return stopping || queued_count.load(std::memory_order_acquire) > 0; });
+            if (stopping && queued_count.load(std::memory_order_acquire) == 0)
+                return;
+        }
+    }
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+
+    std::atomic<size_t> queued_count{0};
+    std::atomic<size_t> unfinished{0};
+    std::atomic<size_t> next_worker{0};
+
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    bool stopping = false;
+
+    static inline thread_local ThreadPool* current_pool = nullptr;
+    static inline thread_local int current_worker = 0;
+};
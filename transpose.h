@@ -0,0 +1,261 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+
+#include "image.h"
+#include "parallel.h"
+#include "simd.h"
+
+// lossless right-angle rotations (clockwise) and flips
+enum class Orientation {
+    identity,  // plain copy
+    rotate_90,
+    rotate_180,
+    rotate_270,
+    flip_horizontal,
+    flip_vertical,
+    transpose,
+};
+
+// Output is produced in square tiles of this many pixels; a source tile and a
+// destination tile (2 x 32 x 32 x 4 bytes = 8 KB) stay resident in L1 while
+// every cache line of both is used completely.
+constexpr int TRANSPOSE_TILE = 32;
+
+// Copy a bw x bh block of Bytes-byte pixels with rows and columns exchanged.
+// Source row i starts at src + i * src_step, destination row k starts at
+// dst + k * dst_step, and destination pixel (i, k) is source pixel (k, i).
+// Negative steps mirror.
+template <int Bytes>
+inline void transpose_block_scalar(const unsigned char* src, ptrdiff_t src_step,
+                                   unsigned char* dst, ptrdiff_t dst_step, int bw, int bh) {
+    for (int i = 0; i < bh; ++i) {
+        const unsigned char* s = src + i * src_step;
+        for (int k = 0; k < bw; ++k) {
+            copy_pixel<Bytes>(dst + k * dst_step + i * Bytes, s + k * Bytes);
+        }
+    }
+}
+
+using TransposeBlock = void (*)(const unsigned char* src, ptrdiff_t src_step, unsigned char* dst, ptrdiff_t dst_step);
+
+#ifdef ROTATE_X86
+
+// 4x4 block of 32-bit pixels
+__attribute__((target("sse2")))
+inline void transpose_block_sse2(const unsigned char* src, ptrdiff_t src_step, unsigned char* dst, ptrdiff_t dst_step) {
+    __m128i r0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+    __m128i r1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + src_step));
+    __m128i r2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 2 * src_step));
+    __m128i r3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 3 * src_step));
+
+    __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+    __m128i t1 = _mm_unpackhi_epi32(r0, r1);
+    __m128i t2 = _mm_unpacklo_epi32(r2, r3);
+    __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_unpacklo_epi64(t0, t2));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + dst_step), _mm_unpackhi_epi64(t0, t2));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 2 * dst_step), _mm_unpacklo_epi64(t1, t3));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + 3 * dst_step), _mm_unpackhi_epi64(t1, t3));
+}
+
+// 8x8 block of 32-bit pixels
+__attribute__((target("avx2")))
+inline void transpose_block_avx2(const unsigned char* src, ptrdiff_t src_step, unsigned char* dst, ptrdiff_t dst_step) {
+    __m256i r[8];
+    for (int i = 0; i < 8; ++i) {
+        r[i] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i * src_step));
+    }
+
+    __m256i t[8];
+    for (int i = 0; i < 8; i += 2) {
+        t[i] = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+        t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+    }
+
+    __m256i u[8];
+    for (int i = 0; i < 8; i += 4) {
+        u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+        u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+        u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+        u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+    }
+
+    for (int k = 0; k < 4; ++k) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + k * dst_step), _mm256_permute2x128_si256(u[k], u[k + 4], 0x20));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + (k + 4) * dst_step), _mm256_permute2x128_si256(u[k], u[k + 4], 0x31));
+    }
+}
+
+#endif  // ROTATE_X86
+
+inline int transpose_block_size(SimdLevel level, TransposeBlock& block) {
+    switch (level) {
+#ifdef ROTATE_X86
+    case SimdLevel::avx512:
+    case SimdLevel::avx2:
+        block = transpose_block_avx2;
+        return 8;
+    case SimdLevel::sse2:
+        block = transpose_block_sse2;
+        return 4;
+#endif
+    default:
+        block = nullptr;
+        return 8;
+    }
+}
+
+// Rows [row_begin, row_end) of the transpose of a width x height source, with
+// optional mirroring: destination pixel (c, r) is source pixel
+// (MirrorX ? width - 1 - r : r, MirrorY ? height - 1 - c : c). The mirroring
+// and the pixel size are template parameters, so each orientation and format
+// gets its own inner loops; the register transposes move 4-byte pixels only.
+template <bool MirrorX, bool MirrorY, int Bytes>
+inline void transpose_rows(const unsigned char* src, size_t src_stride, int width, int height,
+                           unsigned char* dst, size_t dst_stride, int row_begin, int row_end) {
+    TransposeBlock block = nullptr;
+    int b = Bytes == 4 ? transpose_block_size(active_simd_level, block) : 8;
+
+    ptrdiff_t src_step = MirrorY ? -static_cast<ptrdiff_t>(src_stride) : static_cast<ptrdiff_t>(src_stride);
+    ptrdiff_t dst_step = MirrorX ? -static_cast<ptrdiff_t>(dst_stride) : static_cast<ptrdiff_t>(dst_stride);
+
+    for (int rt = row_begin; rt < row_end; rt += TRANSPOSE_TILE) {
+        int re = std::min(rt + TRANSPOSE_TILE, row_end);
+        for (int ct = 0; ct < height; ct += TRANSPOSE_TILE) {
+            int ce = std::min(ct + TRANSPOSE_TILE, height);
+            for (int r = rt; r < re; r += b) {
+                int bw = std::min(b, re - r);
+                int sx = MirrorX ? width - r - bw : r;
+                unsigned char* d_row = dst + static_cast<size_t>(MirrorX ? r + bw - 1 : r) * dst_stride;
+                for (int c = ct; c < ce; c += b) {
+                    int bh = std::min(b, ce - c);
+                    int sy = MirrorY ? height - 1 - c : c;
+                    const unsigned char* s = src + static_cast<size_t>(sy) * src_stride + static_cast<size_t>(sx) * Bytes;
+                    unsigned char* d = d_row + static_cast<size_t>(c) * Bytes;
+                    if (block && bw == b && bh == b) {
+                        block(s, src_step, d, dst_step);
+                    } else {
+                        transpose_block_scalar<Bytes>(s, src_step, d, dst_step, bw, bh);
+                    }
+                }
+            }
+        }
+    }
+}
+
+#ifdef ROTATE_X86
+// reverse 4 pixels of 32 bits at a time, returns how many were done
+__attribute__((target("sse2")))
+inline int reverse_pixels_sse2(const unsigned char* src, unsigned char* dst, int n) {
+    int x = 0;
+    for (; x + 4 <= n; x += 4) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + static_cast<size_t>(n - x - 4) * 4));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + static_cast<size_t>(x) * 4),
+                         _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3)));
+    }
+    return x;
+}
+#endif
+
+// reverse the order of n pixels of Bytes bytes
+template <int Bytes>
+inline void reverse_pixels(const unsigned char* src, unsigned char* dst, int n) {
+    int x = 0;
+#ifdef ROTATE_X86
+    if (Bytes == 4 && active_simd_level >= SimdLevel::sse2)
+        x = reverse_pixels_sse2(src, dst, n);
+#endif
+    for (; x < n; ++x) {
+        copy_pixel<Bytes>(dst + static_cast<size_t>(x) * Bytes, src + static_cast<size_t>(n - 1 - x) * Bytes);
+    }
+}
+
+// Rows [row_begin, row_end) of a mirrored copy: destination pixel (x, r) is
+// source pixel (MirrorX ? width - 1 - x : x, MirrorY ? height - 1 - r : r).
+// Both sides are walked sequentially, so no tiling is needed.
+template <bool MirrorX, bool MirrorY, int Bytes>
+inline void mirror_rows(const unsigned char* src, size_t src_stride, int width, int height,
+                        unsigned char* dst, size_t dst_stride, int row_begin, int row_end) {
+    for (int r = row_begin; r < row_end; ++r) {
+        const unsigned char* s = src + static_cast<size_t>(MirrorY ? height - 1 - r : r) * src_stride;
+        unsigned char* d = dst + static_cast<size_t>(r) * dst_stride;
+        if constexpr (MirrorX) {
+            reverse_pixels<Bytes>(s, d, width);
+        } else {
+            std::memcpy(d, s, static_cast<size_t>(width) * Bytes);
+        }
+    }
+}
+
+constexpr bool swaps_axes(Orientation orientation) {
+    return orientation == Orientation::rotate_90 || orientation == Orientation::rotate_270 ||
+           orientation == Orientation::transpose;
+}
+
+// rows [row_begin, row_end) of `rotated`, which must already have the oriented
+// size and the format of image_data
+template <Orientation O, int Bytes>
+inline void orient_rows(const Image& image_data, Image& rotated, int row_begin, int row_end) {
+    const unsigned char* src = image_data.data();
+    size_t stride = image_data.stride;
+    int width = image_data.width;
+    int height = image_data.height;
+    unsigned char* dst = rotated.data();
+
+    if constexpr (O == Orientation::rotate_90) {
+        transpose_rows<false, true, Bytes>(src, stride, width, height, dst, rotated.stride, row_begin, row_end);
+    } else if constexpr (O == Orientation::rotate_270) {
+        transpose_rows<true, false, Bytes>(src, stride, width, height, dst, rotated.stride, row_begin, row_end);
+    } else if constexpr (O == Orientation::transpose) {
+        transpose_rows<false, false, Bytes>(src, stride, width, height, dst, rotated.stride, row_begin, row_end);
+    } else if constexpr (O == Orientation::rotate_180) {
+        mirror_rows<true, true, Bytes>(src, stride, width, height, dst, rotated.stride, row_begin, row_end);
+    } else if constexpr (O == Orientation::flip_horizontal) {
+        mirror_rows<true, false, Bytes>(src, stride, width, height, dst, rotated.stride, row_begin, row_end);
+    } else if constexpr (O == Orientation::flip_vertical) {
+        mirror_rows<false, true, Bytes>(src, stride, width, height, dst, rotated.stride, row_begin, row_end);
+    } else {
+        mirror_rows<false, false, Bytes>(src, stride, width, height, dst, rotated.stride, row_begin, row_end);
+    }
+}
+
+// Cache-blocked right-angle rotation or flip. 90/270/transpose run over L1-sized
+// tiles with SIMD 8x8 (AVX2) or 4x4 (SSE2) register transposes; 180 and the
+// flips are sequential row copies with in-register pixel reversal. Pixels are
+// moved whole, so the output keeps the format (and palette) of the source.
+template <Orientation O>
+inline Image orient_image(const Image& image_data) {
+    Image rotated = swaps_axes(O) ? Image(image_data.height, image_data.width, image_data.format)
+                                  : Image(image_data.width, image_data.height, image_data.format);
+    with_pixel_bytes(image_data.pixel_bytes, [&](auto bytes) {
+        constexpr int Bytes = decltype(bytes)::value;
+        parallel_rows(rotated.height, rotated.width, TRANSPOSE_TILE, [&](int row_begin, int row_end) {
+            orient_rows<O, Bytes>(image_data, rotated, row_begin, row_end);
+        });
+    });
+    return rotated;
+}
+
+// the same with the orientation picked at run time
+inline Image orient_image(const Image& image_data, Orientation orientation) {
+    switch (orientation) {
+    case Orientation::rotate_90:
+        return orient_image<Orientation::rotate_90>(image_data);
+    case Orientation::rotate_180:
+        return orient_image<Orientation::rotate_180>(image_data);
+    case Orientation::rotate_270:
+        return orient_image<Orientation::rotate_270>(image_data);
+    case Orientation::flip_horizontal:
+        return orient_image<Orientation::flip_horizontal>(image_data);
+    case Orientation::flip_vertical:
+        return orient_image<Orientation::flip_vertical>(image_data);
+    case Orientation::transpose:
+        return orient_image<Orientation::transpose>(image_data);
+    default:
+        return orient_image<Orientation::identity>(image_data);
+    }
+}
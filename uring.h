@@ -0,0 +1,170 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Minimal io_uring ring on the raw system calls (no liburing): one submission
+// and one completion ring, no SQPOLL. Only the calling thread may use it.
+class IoUring {
+public:
+    explicit IoUring(unsigned entries) {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+        if (fd < 0)
+            throw std::runtime_error(std::string("io_uring_setup: ") + std::strerror(errno));
+
+        sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap) {
+            sq_size = cq_size = std::max(sq_size, cq_size);
+        }
+        sq_ptr = ::mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED) {
+            sq_ptr = nullptr;
+            fail("mmap of the submission ring");
+        }
+        if (single_mmap) {
+            cq_ptr = sq_ptr;
+        } else {
+            cq_ptr = ::mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if (cq_ptr == MAP_FAILED) {
+                cq_ptr = nullptr;
+                fail("mmap of the completion ring");
+            }
+        }
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        void* p = ::mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (p == MAP_FAILED)
+            fail("mmap of the submission entries");
+        sqes = static_cast<io_uring_sqe*>(p);
+
+        char* sq = static_cast<char*>(sq_ptr);
+        sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        sq_entries = params.sq_entries;
+        local_tail = submitted = *sq_tail;
+
+        char* cq = static_cast<char*>(cq_ptr);
+        cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    }
+
+    ~IoUring() { release(); }
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    // true if the ring supports every opcode in ops
+    bool supports(const std::vector<int>& ops) const {
+        std::vector<unsigned char> buffer(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+        io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(buffer.data());
+        if (::syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+            return false;
+        for (int op : ops) {
+            if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+                return false;
+        }
+        return true;
+    }
+
+    // a cleared submission entry, or nullptr if the ring is full
+    io_uring_sqe* get_sqe() {
+        unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (local_tail - head >= sq_entries)
+            return nullptr;
+        unsigned index = local_tail & sq_mask;
+        sq_array[index] = index;
+        io_uring_sqe* sqe = &sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        ++local_tail;
+        return sqe;
+    }
+
+    // hand the new entries to the kernel and wait for at least wait_nr completions
+    void submit(unsigned wait_nr) {
+        __atomic_store_n(sq_tail, local_tail, __ATOMIC_RELEASE);
+        unsigned to_submit = local_tail - submitted;
+        while (true) {
+            long n = ::syscall(__NR_io_uring_enter, fd, to_submit, wait_nr,
+                               wait_nr ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (n >= 0) {
+                submitted += static_cast<unsigned>(n);
+                return;
+            }
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                throw std::runtime_error(std::string("io_uring_enter: ") + std::strerror(errno));
+            // EAGAIN/EBUSY: completions have to be reaped first
+            if (errno != EINTR)
+                return;
+        }
+    }
+
+    // take the next completion, if any
+    bool next_completion(io_uring_cqe& cqe) {
+        unsigned head = *cq_head;
+        if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+            return false;
+        cqe = cqes[head & cq_mask];
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+private:
+    [[noreturn]] void fail(const char* what) {
+        int err = errno;
+        release();
+        throw std::runtime_error(std::string(what) + ": " + std::strerror(err));
+    }
+
+    void release() {
+        if (sqes)
+            ::munmap(sqes, sqes_size);
+        if (cq_ptr && cq_ptr != sq_ptr)
+            ::munmap(cq_ptr, cq_size);
+        if (sq_ptr)
+            ::munmap(sq_ptr, sq_size);
+        if (fd >= 0)
+            ::close(fd);
+        sqes = nullptr;
+        cq_ptr = sq_ptr = nullptr;
+        fd = -1;
+    }
+
+    int fd = -1;
+
+    void* sq_ptr = nullptr;
+    size_t sq_size = 0;
+    unsigned* sq_head = nullptr;
+    unsigned* sq_tail = nullptr;
+    unsigned* sq_array = nullptr;
+    unsigned sq_mask = 0;
+    unsigned sq_entries = 0;
+    unsigned local_tail = 0;  // entries prepared so far
+    unsigned submitted = 0;   // entries the kernel has consumed
+
+    io_uring_sqe* sqes = nullptr;
+    size_t sqes_size = 0;
+
+    void* cq_ptr = nullptr;
+    size_t cq_size = 0;
+    unsigned* cq_head = nullptr;
+    unsigned* cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    io_uring_cqe* cqes = nullptr;
+};